@@ -1,108 +1,1052 @@
 #include "alloc.hpp"
 #include <cassert>
 #include <stdexcept>
+#include <new>
 #include <iostream>
 #include <iomanip>
+#include <cstring>
+#include <cstdlib>
+#include <ctime>
+#include <algorithm>
 #include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#if defined(__x86_64__) && defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define ALLOC_HAVE_RSEQ 1
+#endif
+#endif
+
+// Back regions with huge pages: 0 is off, 1 tries MAP_HUGETLB, then
+// transparent huge pages, 2 only uses transparent huge pages.  The
+// ATOMIC_MALLOC_HUGEPAGES environment variable overrides it.
+#ifndef ALLOC_HUGEPAGES
+#define ALLOC_HUGEPAGES 0
+#endif
+
+// Region growth policy: 0 maps every region with the minimal size, 1
+// doubles the size of each next region up to ALLOC_MAX_REGION_SIZE.
+// Overridden by ATOMIC_MALLOC_REGION_GROWTH and
+// ATOMIC_MALLOC_MAX_REGION_SIZE.
+#ifndef ALLOC_REGION_GROWTH
+#define ALLOC_REGION_GROWTH 1
+#endif
+#ifndef ALLOC_MAX_REGION_SIZE
+#define ALLOC_MAX_REGION_SIZE (32 * 1024 * 1024)
+#endif
+
+// Map the next region in a helper thread before the current one runs
+// out: 0 is off, 1 maps it, 2 also pre-faults it.  Overridden by
+// ATOMIC_MALLOC_PREMAP.
+#ifndef ALLOC_PREMAP
+#define ALLOC_PREMAP 0
+#endif
+
+// Return the pages of spans that stay completely free for
+// ALLOC_PURGE_DECAY milliseconds to the kernel: 0 is off, 1 uses
+// MADV_DONTNEED, which drops them from the resident set at once, 2
+// MADV_FREE, which lets the kernel take them when memory runs low.
+// Overridden by ATOMIC_MALLOC_PURGE and ATOMIC_MALLOC_PURGE_DECAY.
+#ifndef ALLOC_PURGE
+#define ALLOC_PURGE 1
+#endif
+#ifndef ALLOC_PURGE_DECAY
+#define ALLOC_PURGE_DECAY 1000
+#endif
+
+// Keep up to that many bytes of unmapped large objects and unused
+// regions mapped, for reuse by the next large object or region.
+// Overridden by ATOMIC_MALLOC_MAP_CACHE; 0 turns the cache off.
+#ifndef ALLOC_MAP_CACHE
+#define ALLOC_MAP_CACHE (32 * 1024 * 1024)
+#endif
+
+// Bound on the internal fragmentation of the size classes, in percent
+// of the request: each class is at most that much larger than the one
+// below.  Smaller values give more classes; see SizeClassTable.
+#ifndef ALLOC_CLASS_WASTE
+#define ALLOC_CLASS_WASTE 25
+#endif
+
+// Cache free blocks per CPU instead of per thread, with restartable
+// sequences: 0 is off, 1 is on where the kernel and glibc support
+// rseq.  Overridden by ATOMIC_MALLOC_PERCPU.
+#ifndef ALLOC_PERCPU
+#define ALLOC_PERCPU 0
+#endif
 
 constexpr std::size_t DEFAULT_ALLOC_SIZE = 64 * 1024;
-constexpr size_t ALIGN_SIZE = 8;
+// Blocks are aligned for any fundamental type, as malloc promises.
+constexpr size_t ALIGN_SIZE = alignof(std::max_align_t);
+// Except the smallest class, of MIN_ALIGN_SIZE bytes: nothing that
+// needs more alignment fits, and empty objects take no padding.
+constexpr size_t MIN_ALIGN_SIZE = 8;
+constexpr unsigned PAGE_SHIFT = 12;
+constexpr std::size_t PAGE_SIZE = std::size_t(1) << PAGE_SHIFT;
+constexpr std::size_t CACHE_LINE_SIZE = 64;
+
+// Small objects are carved from spans: page-aligned runs of pages that
+// hold blocks of a single size class, taken from the shared region.
+// Each thread bump-allocates from a span of its own per class, so the
+// shared atomics are touched only on refill.  A span has room for at
+// least four blocks.  Its first page is never purged, so spans are not
+// much smaller than a region.
+constexpr std::size_t MIN_SPAN_SIZE = DEFAULT_ALLOC_SIZE;
+constexpr std::size_t MIN_SPAN_BLOCKS = 4;
+// The span descriptor takes the start of the span; blocks follow it.
+// Blocks have no header: free finds the span through the page map.
+// Small spans extend the descriptor with their slab bitmap, so this is
+// the minimal size.
+constexpr std::size_t SPAN_HEADER_SIZE = CACHE_LINE_SIZE;
+
+// Objects up to MAX_SMALL_SIZE are rounded up to a size class and
+// reused through the slabs of their class; see SizeClass.
+constexpr std::size_t MAX_SMALL_SIZE = 32 * 1024;
+// Larger objects get a span of their own, mapped directly and unmapped
+// on free.
+constexpr unsigned LARGE_CLASS = 0xff;
+
+/**
+ * Size classes, computed by the compiler: MIN_ALIGN_SIZE, then
+ * ALIGN_SIZE steps as long as they are within MaxWaste percent of the
+ * class below, then geometric steps of MaxWaste percent, rounded down
+ * to ALIGN_SIZE, up to MAX_SMALL_SIZE.  All classes but the first are
+ * multiples of ALIGN_SIZE.  by_size maps a size, in MIN_ALIGN_SIZE
+ * units rounded up, to its class, so that a lookup is a shift and a
+ * load.
+ */
+template<unsigned MaxWaste>
+struct SizeClassTable {
+    std::uint32_t size[LARGE_CLASS];
+    unsigned count;
+    std::uint8_t by_size[MAX_SMALL_SIZE / MIN_ALIGN_SIZE + 1];
+
+    constexpr SizeClassTable() : size(), count(0), by_size() {
+        std::size_t cur = MIN_ALIGN_SIZE;
+        while (count < LARGE_CLASS) {
+            size[count++] = cur;
+            if (cur == MAX_SMALL_SIZE) {
+                break;
+            }
+            std::size_t next = cur * (100 + MaxWaste) / 100 & ~(ALIGN_SIZE - 1);
+            std::size_t step = (cur + ALIGN_SIZE) & ~(ALIGN_SIZE - 1);
+            cur = std::min(std::max(next, step), MAX_SMALL_SIZE);
+        }
+        unsigned cls = 0;
+        for (std::size_t units = 0; units <= MAX_SMALL_SIZE / MIN_ALIGN_SIZE; ++units) {
+            if (units * MIN_ALIGN_SIZE > size[cls] && cls + 1 < count) {
+                ++cls;
+            }
+            by_size[units] = cls;
+        }
+    }
+};
+
+constexpr SizeClassTable<ALLOC_CLASS_WASTE> SIZE_CLASSES;
+constexpr unsigned NUM_CLASSES = SIZE_CLASSES.count;
+
+// The page map covers the user half of a 48-bit address space with a
+// root of 1 << PAGE_MAP_ROOT_BITS leaves, which are mapped on first
+// use; a leaf covers 1 GiB.
+constexpr unsigned ADDRESS_BITS = 48;
+constexpr unsigned PAGE_MAP_LEAF_BITS = 18;
+constexpr unsigned PAGE_MAP_ROOT_BITS = ADDRESS_BITS - PAGE_SHIFT - PAGE_MAP_LEAF_BITS;
+
+// A span keeps the id of the heap it belongs to; a block freed by a
+// thread other than its owner goes back to the owner.
+constexpr unsigned MAX_HEAPS = 1 << 16;
+// Remote frees are handed over to the owner in batches of that many
+// blocks.
+constexpr std::size_t REMOTE_BATCH = 64;
+
+// Spans that become free again while queued for purging look at the
+// queue every that many times.
+constexpr unsigned PURGE_CHECK_EVENTS = 64;
+
+// A per-CPU free list that runs empty is refilled with about that
+// many bytes of blocks, bumped from the span of the thread at once.
+constexpr std::size_t CPU_REFILL_SIZE = MIN_SPAN_SIZE / 16;
+
+// Tails of replaced regions are kept in a small pool, binned by the
+// order of their size, and reused before mapping a new region.  Tails
+// smaller than 1 << MIN_TAIL_ORDER are dropped.
+constexpr unsigned MIN_TAIL_ORDER = 6;
+constexpr unsigned NUM_TAIL_BINS = 10;
+constexpr unsigned TAIL_SLOTS = 4;
+
+// Cached mappings are binned by the order of their size in pages.  A
+// request takes one from its own bin or the next, up to twice its
+// size.
+constexpr unsigned NUM_MAP_BINS = 16;
+constexpr unsigned MAP_SLOTS = 4;
+
+// Spans that stayed completely free go back to the span pool, binned
+// by the order of their size in pages and striped by heap id, so that
+// threads refilling at the same time mostly use different stacks.  A
+// request takes a span from the bin whose spans all fit it, that is
+// less than four times its size.  Larger spans stay with their heap.
+constexpr unsigned NUM_SPAN_BINS = 12;
+constexpr unsigned SPAN_POOL_STRIPES = 8;
+
+// In huge page mode, regions are multiples of HUGE_PAGE_SIZE and
+// aligned to it.
+constexpr std::size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+enum HugePageMode { HUGE_OFF = 0, HUGE_AUTO = 1, HUGE_THP = 2 };
+enum PremapMode { PREMAP_OFF = 0, PREMAP_MAP = 1, PREMAP_POPULATE = 2 };
+enum PurgeMode { PURGE_OFF = 0, PURGE_DONTNEED = 1, PURGE_FREE = 2 };
+// Place of a span in the purge queue; refreshed ones were freed again
+// while queued, so their free time is later than their place says.
+enum PurgeState : std::uint8_t { PURGE_IDLE = 0, PURGE_QUEUED = 1, PURGE_REFRESHED = 2 };
 
 static_assert(!(ALIGN_SIZE & (ALIGN_SIZE - 1)),
               "ALIGN_SIZE has to be a power of two");
 static_assert(DEFAULT_ALLOC_SIZE % ALIGN_SIZE == 0,
               "DEFAULT_ALLOC_SIZE has to be aligned to ALIGN_SIZE'd");
+static_assert(MIN_SPAN_SIZE % PAGE_SIZE == 0,
+              "MIN_SPAN_SIZE has to be a multiple of PAGE_SIZE");
+static_assert(SPAN_HEADER_SIZE % ALIGN_SIZE == 0,
+              "blocks after the span header have to be aligned to ALIGN_SIZE'd");
+static_assert(ALIGN_SIZE % MIN_ALIGN_SIZE == 0 && MIN_ALIGN_SIZE >= sizeof(void*),
+              "MIN_ALIGN_SIZE has to divide ALIGN_SIZE and hold a free list link");
+static_assert(MAX_SMALL_SIZE % ALIGN_SIZE == 0,
+              "MAX_SMALL_SIZE blocks have to be aligned to ALIGN_SIZE'd");
+static_assert(SIZE_CLASSES.size[NUM_CLASSES - 1] == MAX_SMALL_SIZE,
+              "ALLOC_CLASS_WASTE is too small for LARGE_CLASS classes");
+static_assert(DEFAULT_ALLOC_SIZE % PAGE_SIZE == 0,
+              "regions have to be made of whole pages");
+static_assert(HUGE_PAGE_SIZE % DEFAULT_ALLOC_SIZE == 0,
+              "HUGE_PAGE_SIZE has to be a multiple of DEFAULT_ALLOC_SIZE");
+
+namespace {
+struct FreeBlock {
+    FreeBlock* next;
+};
+
+// At the start of a cached mapping.  A dirty one was written to; a
+// clean one is zero but for this header.
+struct CachedMapping {
+    std::size_t size;
+    bool dirty;
+};
+}
+
+/**
+ * Per-thread allocation state.  Only the owner thread touches it,
+ * except for remote_free, so allocation is a plain pointer bump or
+ * free list pop.
+ *
+ * begin and end bound the unused part of the span the thread bumps
+ * for each size class.  Blocks of its own spans freed by the thread
+ * are marked in the slab bitmap of their span, and spans with marked
+ * slots are kept in slabs, so that freed slots are reused lowest
+ * address first.  Blocks freed by other threads are pushed onto
+ * remote_free in batches and marked by the owner when its slabs of a
+ * class run empty.  Blocks of other heaps freed by this thread are
+ * collected into the pending chain, which is pushed to its owner in
+ * one CAS.  The free lists only take blocks without an owner.
+ *
+ * When its thread exits, the heap is abandoned and adopted, spans,
+ * free lists and all, by the next thread that needs a heap.
+ */
+struct MemorySingleton::ThreadHeap {
+    char* begin[NUM_CLASSES];
+    char* end[NUM_CLASSES];
+    MemorySingleton::Span* slabs[NUM_CLASSES];
+    FreeBlock* free_lists[NUM_CLASSES];
+    // Spans that became completely free, oldest first, and the count
+    // of such events, to look at the queue now and then.
+    MemorySingleton::Span* purge_head;
+    MemorySingleton::Span* purge_tail;
+    unsigned purge_events;
+
+    unsigned id;
+    unsigned pending_owner;
+    std::size_t pending_count;
+    FreeBlock* pending_head;
+    FreeBlock* pending_tail;
+
+    // Statistics, written by the owner only and summed when read.
+    // Index NUM_CLASSES counts large objects.
+    std::atomic<std::size_t> alloc_bytes;
+    std::atomic<std::size_t> free_bytes;
+    std::atomic<std::size_t> alloc_count[NUM_CLASSES + 1];
+    std::atomic<std::size_t> free_count[NUM_CLASSES + 1];
+    // All heaps, for statistics and adoption.
+    ThreadHeap* next_heap;
+    std::atomic<bool> abandoned;
+
+    // Written by other threads: keep it off the owner's cache lines.
+    alignas(CACHE_LINE_SIZE) std::atomic<FreeBlock*> remote_free;
+};
+
+/**
+ * Descriptor of a span, in its first SPAN_HEADER_SIZE bytes.  Every
+ * page of the span maps to it in the page map, so the size class and
+ * the owner of a block are found from its address alone.
+ */
+struct MemorySingleton::Span {
+    // In bytes, descriptor included.
+    std::size_t size;
+    // ceil(2^64 / block size), to divide by a multiplication.
+    std::uint64_t reciprocal;
+    // LARGE_CLASS for a large object.
+    unsigned cls;
+    // Heap that carves blocks from the span; 0 for none.
+    unsigned owner;
+    // Offset of the first block: the descriptor and the bitmap.
+    std::uint32_t block_offset;
+    // Set once a pointer into the middle of a block is handed out by
+    // AllocateAligned; Free then has to find the block start.
+    std::atomic<bool> aligned;
+
+    // Slab state, touched by the owner only.  The bitmap follows the
+    // descriptor and has a bit set for every freed slot; no bit below
+    // first_word is set.  next_slab links the spans with set bits.
+    // The purge fields place the span in the purge queue of the owner,
+    // see QueuePurge; free_time is in milliseconds and wraps around.
+    // A span that goes to the span pool is marked released first, and
+    // there next_slab links the pool.  A dirty one was not zeroed by
+    // the purge.
+    PurgeState purge_state;
+    bool released;
+    bool dirty;
+    std::uint32_t first_word;
+    std::uint32_t free_time;
+    std::size_t free_slots;
+    MemorySingleton::Span* next_slab;
+    MemorySingleton::Span* next_purge;
+};
+
+static_assert(sizeof(MemorySingleton::Span) <= SPAN_HEADER_SIZE,
+              "Span has to fit into SPAN_HEADER_SIZE");
+
+// Free lists of one CPU, changed only in restartable sequences.
+struct alignas(CACHE_LINE_SIZE) MemorySingleton::CpuCache {
+    FreeBlock* free_lists[NUM_CLASSES];
+};
+
+// initial-exec: the library is either linked or preloaded, and the
+// default model may call malloc from __tls_get_addr.
+static thread_local MemorySingleton::ThreadHeap* thread_heap
+    __attribute__((tls_model("initial-exec")));
+// Set once the thread released its heap on exit; see FreeExited.
+static thread_local bool thread_exited
+    __attribute__((tls_model("initial-exec")));
+
+// Heap by owner id of a block; id 0 is reserved for blocks without
+// an owner.
+static std::atomic<MemorySingleton::ThreadHeap*> heaps[MAX_HEAPS];
+static std::atomic<unsigned> heap_count{0};
+static std::atomic<MemorySingleton::ThreadHeap*> all_heaps{nullptr};
+
+// Its destructor abandons the heap of an exiting thread.
+static pthread_key_t heap_key;
+static pthread_once_t heap_key_once = PTHREAD_ONCE_INIT;
+
+// Each slot is either empty or owns a tail, which keeps its size in
+// the first word.  Slots are only ever exchanged, so there is no ABA.
+static std::atomic<char*> tail_pool[NUM_TAIL_BINS][TAIL_SLOTS];
+
+// The same for cached mappings, which keep a CachedMapping header, and
+// their total size, which is bounded by the setting.
+static std::atomic<char*> map_cache[NUM_MAP_BINS][MAP_SLOTS];
+static std::atomic<std::size_t> map_cache_size{0};
+
+/**
+ * Top of a Treiber stack of pooled spans.  Both words are replaced
+ * together with a double-width CAS, and every push and pop bumps the
+ * tag, so a pop that read a top which was taken and pushed back
+ * meanwhile fails instead of installing a stale next link (ABA).
+ * Pooled spans stay mapped, so reading the link of a stale top is
+ * harmless.
+ */
+struct alignas(16) TaggedSpan {
+    MemorySingleton::Span* top;
+    std::uint64_t tag;
+};
+
+// One stack per cache line.
+struct alignas(CACHE_LINE_SIZE) SpanStack {
+    TaggedSpan head;
+};
+
+static SpanStack span_pool[NUM_SPAN_BINS][SPAN_POOL_STRIPES];
+static std::atomic<std::size_t> span_pool_size{0};
+
+// Settings, -1 until read from the environment.
+static std::atomic<long> huge_page_mode{-1};
+static std::atomic<long> region_growth{-1};
+static std::atomic<long> max_region_size{-1};
+static std::atomic<long> premap_mode{-1};
+static std::atomic<long> per_cpu_mode{-1};
+static std::atomic<long> purge_mode{-1};
+static std::atomic<long> purge_decay{-1};
+static std::atomic<long> map_cache_limit{-1};
+
+// Size of the next region; only updated by the thread that installs
+// a region.
+static std::atomic<std::size_t> region_size{0};
+
+// Region mapped ahead by the premap thread, and its size.  The thread
+// sleeps on premap_wanted until the current region runs low.
+static std::atomic<char*> premapped{nullptr};
+static std::atomic<std::size_t> premapped_size{0};
+static std::atomic<int> premap_wanted{0};
+static std::atomic<bool> premap_running{false};
+
+// Page map: span by page number, in leaves of 1 << PAGE_MAP_LEAF_BITS
+// entries.  Leaves are mapped on demand and never unmapped, so lookups
+// need no synchronization besides the acquire loads.
+static std::atomic<std::atomic<MemorySingleton::Span*>*> page_map[1 << PAGE_MAP_ROOT_BITS];
+static std::atomic<std::size_t> page_map_size{0};
 
-std::atomic<char*> MemorySingleton::free_end{0};
-std::atomic<char*> MemorySingleton::free_begin{0};
-std::atomic<bool> MemorySingleton::in_alloc{0};
-std::atomic<std::size_t> MemorySingleton::alloc_stat{0};
+// Per-CPU caches, indexed by CPU number, allocated on first use.
+static std::atomic<MemorySingleton::CpuCache*> cpu_caches{nullptr};
+static std::atomic<unsigned> cpu_count{0};
+
+/**
+ * Free part [begin, end) of the shared region.  Both pointers are
+ * replaced together with a double-width CAS (cmpxchg16b), so swapping
+ * in a new region is a single atomic step.
+ */
+struct alignas(16) MemorySingleton::Region {
+    char* begin;
+    char* end;
+
+    std::size_t Free() const {
+        return end && begin < end ? end - begin : 0;
+    }
+};
+
+MemorySingleton::Region MemorySingleton::region{nullptr, nullptr};
 std::atomic<std::size_t> MemorySingleton::sbrk_stat{0};
+std::atomic<std::size_t> MemorySingleton::mmap_stat{0};
+std::atomic<std::size_t> MemorySingleton::peak_stat{0};
+std::atomic<std::size_t> MemorySingleton::tail_stat{0};
+std::atomic<std::size_t> MemorySingleton::lost_stat{0};
+std::atomic<std::size_t> MemorySingleton::hugetlb_stat{0};
+std::atomic<std::size_t> MemorySingleton::arena_stat{0};
+std::atomic<std::size_t> MemorySingleton::premap_stat{0};
+std::atomic<std::size_t> MemorySingleton::purge_stat{0};
+std::atomic<std::size_t> MemorySingleton::pool_put_stat{0};
+std::atomic<std::size_t> MemorySingleton::pool_take_stat{0};
+
+/**
+ * Numeric setting: the environment variable if set, def otherwise.
+ * It is read once, as getenv is not cheap.
+ */
+static long GetSetting(std::atomic<long>* cache, const char* name, long def) {
+    long value = cache->load(std::memory_order_relaxed);
+    if (value < 0) {
+        const char* env = getenv(name);
+        value = env ? atol(env) : def;
+        if (value < 0) {
+            value = def;
+        }
+        cache->store(value, std::memory_order_relaxed);
+    }
+    return value;
+}
+
+static int GetHugePageMode() {
+    return GetSetting(&huge_page_mode, "ATOMIC_MALLOC_HUGEPAGES", ALLOC_HUGEPAGES);
+}
+
+// Regions are multiples of it.
+static inline std::size_t RegionUnit() {
+    return GetHugePageMode() != HUGE_OFF ? HUGE_PAGE_SIZE : DEFAULT_ALLOC_SIZE;
+}
 
 /**
- * Allocation size for sbrk.  sbrk is always called if requested
- * memory is larger than DEFAULT_ALLOC_SIZE, in this case we Returned
- * value is multiply of DEFAULT_ALLOC_SIZE.  Returned value is always
- * larger than requested, even if size is multiply of
- * DEFAULT_ALLOC_SIZE.
+ * Allocation size for sbrk: the size of the next region, or size
+ * rounded up to a multiple of RegionUnit if that is larger.  Large
+ * objects never get here, so in practice it is the former.
  */
 static inline std::size_t SbrkAllocSize(std::size_t size) {
-    size &= ~(DEFAULT_ALLOC_SIZE - 1);
-    // Always sbrk more than requested.
-    size += DEFAULT_ALLOC_SIZE;
-    return size;
+    std::size_t unit = RegionUnit();
+    size = (size + (unit - 1)) & ~(unit - 1);
+    return std::max(size, std::max(unit, region_size.load(std::memory_order_relaxed)));
 }
 
+/**
+ * Size of the next region after mapping one of alloc_size bytes, if
+ * the growth policy says so.  Doubling keeps the number of mmap calls
+ * logarithmic in the heap size while small programs stay small.
+ */
+static inline std::size_t NextRegionSize(std::size_t alloc_size) {
+    std::size_t unit = RegionUnit();
+    if (!GetSetting(&region_growth, "ATOMIC_MALLOC_REGION_GROWTH", ALLOC_REGION_GROWTH)) {
+        return unit;
+    }
+    std::size_t max_size = GetSetting(&max_region_size, "ATOMIC_MALLOC_MAX_REGION_SIZE",
+                                      ALLOC_MAX_REGION_SIZE);
+    max_size = std::max(unit, max_size & ~(unit - 1));
+    return std::min(2 * alloc_size, max_size);
+}
 
-// Note that SbrkAllocSize(AlignSize(size)) == SbrkAllocSize(size)
-static inline std::size_t AlignSize(std::size_t size) {
-    // 8-bytes alignment
-    if (size == 0) {
-        return ALIGN_SIZE;
+static inline void GrowRegionSize(std::size_t alloc_size) {
+    region_size.store(NextRegionSize(alloc_size), std::memory_order_relaxed);
+}
+
+
+// Size class of a small object.
+static inline unsigned SizeClass(std::size_t size) {
+    return SIZE_CLASSES.by_size[(size + (MIN_ALIGN_SIZE - 1)) / MIN_ALIGN_SIZE];
+}
+
+// Object size of the size class; SizeClass(ClassSize(c)) == c.
+static inline std::size_t ClassSize(unsigned cls) {
+    return SIZE_CLASSES.size[cls];
+}
+
+static inline std::size_t PageRound(std::size_t size) {
+    return (size + (PAGE_SIZE - 1)) & ~(PAGE_SIZE - 1);
+}
+
+// Descriptor and bitmap of a small span of span_size bytes, padded to
+// a cache line.  The bitmap has a bit for every block that could fit
+// without them.
+static inline std::size_t SlabHeaderSize(std::size_t span_size, std::size_t block_size) {
+    std::size_t words = (span_size / block_size + 63) / 64;
+    return (sizeof(MemorySingleton::Span) + words * sizeof(std::uint64_t) + (CACHE_LINE_SIZE - 1))
+        & ~(CACHE_LINE_SIZE - 1);
+}
+
+/**
+ * Size of a small span with room for at least size bytes of blocks of
+ * the class besides its header: MIN_SPAN_SIZE, or enough pages for
+ * MIN_SPAN_BLOCKS blocks or for size bytes.
+ */
+static inline std::size_t SpanSize(unsigned cls, std::size_t size) {
+    std::size_t block_size = ClassSize(cls);
+    size = std::max(size, MIN_SPAN_BLOCKS * block_size);
+    std::size_t span_size = std::max(MIN_SPAN_SIZE, PageRound(SPAN_HEADER_SIZE + size));
+    while (span_size - SlabHeaderSize(span_size, block_size) < size) {
+        span_size += PAGE_SIZE;
     }
-    return (size + (ALIGN_SIZE - 1)) & ~(ALIGN_SIZE - 1);
+    return span_size;
 }
 
-char* MemorySingleton::AllocSbrk(std::size_t size) {
-    bool in_alloc_expected = false;
-    size_t allocSize = SbrkAllocSize(size);
-    //std::cerr << "Sbrk size " << allocSize << " for " << size << std::endl;
-    if (in_alloc.compare_exchange_weak(in_alloc_expected, true)) {
-        char* sbrk_new = static_cast<char*>(mmap(0, allocSize, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0));
-        sbrk_stat.fetch_add(allocSize);
-        if (sbrk_new == reinterpret_cast<void*>(-1)) {
-            throw std::runtime_error("OOM");
-        } else {
-            assert((((intptr_t)sbrk_new) & (ALIGN_SIZE - 1)) == 0);
-            // We have to update both begin and end together!!!
-            free_begin.store(sbrk_new + size);
-            // Now free_end < free_begin, no allocation in other
-            // thread can happen.
-            
-            // Updating end.
-            free_end.store(sbrk_new + allocSize);
-            in_alloc.store(false);
-            return sbrk_new;
+static inline char* SpanBlocks(MemorySingleton::Span* span) {
+    return reinterpret_cast<char*>(span) + span->block_offset;
+}
+
+static inline std::uint64_t* SlabBitmap(MemorySingleton::Span* span) {
+    return reinterpret_cast<std::uint64_t*>(span + 1);
+}
+
+// Index of the block of a small span that ptr points into.  The
+// multiplication is exact for offsets far beyond any span size.
+static inline std::size_t SlotIndex(MemorySingleton::Span* span, void* ptr) {
+    std::uint64_t offset = static_cast<char*>(ptr) - SpanBlocks(span);
+    return static_cast<std::size_t>((static_cast<unsigned __int128>(offset) * span->reciprocal) >> 64);
+}
+
+// Start of the block of a small span that ptr points into.
+static inline char* BlockStart(MemorySingleton::Span* span, void* ptr) {
+    return SpanBlocks(span) + SlotIndex(span, ptr) * ClassSize(span->cls);
+}
+
+static inline std::uint32_t NowMillis() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return static_cast<std::uint32_t>(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/**
+ * Leaf of the page map for the page, mapped if create is set and it is
+ * missing.  Racing threads both map one; the loser unmaps its copy.
+ * Returns nullptr if there is no leaf.
+ */
+static std::atomic<MemorySingleton::Span*>* PageMapLeaf(std::uintptr_t page, bool create) {
+    std::atomic<std::atomic<MemorySingleton::Span*>*>& slot = page_map[page >> PAGE_MAP_LEAF_BITS];
+    std::atomic<MemorySingleton::Span*>* leaf = slot.load(std::memory_order_acquire);
+    if (leaf || !create) {
+        return leaf;
+    }
+    std::size_t size = sizeof(*leaf) << PAGE_MAP_LEAF_BITS;
+    void* mem = mmap(0, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        return nullptr;
+    }
+    // Zeroed by mmap: no page has a span yet.
+    std::atomic<MemorySingleton::Span*>* fresh = static_cast<std::atomic<MemorySingleton::Span*>*>(mem);
+    if (slot.compare_exchange_strong(leaf, fresh, std::memory_order_acq_rel)) {
+        page_map_size.fetch_add(size);
+        return fresh;
+    }
+    munmap(mem, size);
+    return leaf;
+}
+
+/**
+ * Map every page of [start, start + size) to span, or to nothing if
+ * span is nullptr.  Fails only if a leaf cannot be mapped.
+ */
+static bool SetPageMap(char* start, std::size_t size, MemorySingleton::Span* span) {
+    std::uintptr_t page = reinterpret_cast<std::uintptr_t>(start) >> PAGE_SHIFT;
+    std::uintptr_t last = page + (size >> PAGE_SHIFT);
+    std::atomic<MemorySingleton::Span*>* leaf = nullptr;
+    for (; page < last; ++page) {
+        if (!leaf || !(page & ((std::uintptr_t(1) << PAGE_MAP_LEAF_BITS) - 1))) {
+            leaf = PageMapLeaf(page, span);
+            if (!leaf) {
+                return !span;
+            }
+        }
+        leaf[page & ((std::uintptr_t(1) << PAGE_MAP_LEAF_BITS) - 1)].store(span, std::memory_order_release);
+    }
+    return true;
+}
+
+/**
+ * Span of the block at ptr, or nullptr if the block is not ours (e.g.
+ * from glibc's calloc before the library was loaded).
+ */
+static inline MemorySingleton::Span* FindSpan(void* ptr) {
+    std::uintptr_t page = reinterpret_cast<std::uintptr_t>(ptr) >> PAGE_SHIFT;
+    if (page >> (PAGE_MAP_ROOT_BITS + PAGE_MAP_LEAF_BITS)) {
+        return nullptr;
+    }
+    std::atomic<MemorySingleton::Span*>* leaf = PageMapLeaf(page, false);
+    if (!leaf) {
+        return nullptr;
+    }
+    return leaf[page & ((std::uintptr_t(1) << PAGE_MAP_LEAF_BITS) - 1)].load(std::memory_order_acquire);
+}
+
+/**
+ * Add n to a statistics counter that only the calling thread writes:
+ * a relaxed load and store instead of a locked read-modify-write.
+ */
+static inline void Count(std::atomic<std::size_t>& counter, std::size_t n) {
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+// The last bin also takes all tails that are larger.
+static inline unsigned TailBin(std::size_t size) {
+    unsigned bin = 63 - __builtin_clzll(size) - MIN_TAIL_ORDER;
+    return bin < NUM_TAIL_BINS ? bin : NUM_TAIL_BINS - 1;
+}
+
+/**
+ * Put the unused tail of a region into the pool.  If its bin is full,
+ * the tail is lost.
+ */
+void MemorySingleton::PutTail(char* tail, std::size_t size) {
+    if (size < (std::size_t(1) << MIN_TAIL_ORDER)) {
+        lost_stat.fetch_add(size);
+        return;
+    }
+    *reinterpret_cast<std::size_t*>(tail) = size;
+    std::atomic<char*>* slots = tail_pool[TailBin(size)];
+    for (unsigned i = 0; i < TAIL_SLOTS; ++i) {
+        char* expected = nullptr;
+        if (slots[i].compare_exchange_strong(expected, tail)) {
+            tail_stat.fetch_add(size);
+            return;
+        }
+    }
+    lost_stat.fetch_add(size);
+}
+
+/**
+ * Allocate size bytes from a pooled tail, returning the rest of it to
+ * the pool.  Returns nullptr if no tail is large enough.
+ */
+char* MemorySingleton::TakeTail(std::size_t size) {
+    unsigned first_bin = size < (std::size_t(1) << MIN_TAIL_ORDER) ? 0 : TailBin(size);
+    for (unsigned bin = first_bin; bin < NUM_TAIL_BINS; ++bin) {
+        for (unsigned i = 0; i < TAIL_SLOTS; ++i) {
+            if (!tail_pool[bin][i].load(std::memory_order_relaxed)) {
+                continue;
+            }
+            char* tail = tail_pool[bin][i].exchange(nullptr);
+            if (!tail) {
+                continue;
+            }
+            std::size_t tail_size = *reinterpret_cast<std::size_t*>(tail);
+            tail_stat.fetch_sub(tail_size);
+            if (tail_size < size) {
+                // Only possible in the lowest or the last bin.
+                PutTail(tail, tail_size);
+                continue;
+            }
+            // Callers expect memory fresh from mmap to be zeroed.
+            *reinterpret_cast<std::size_t*>(tail) = 0;
+            if (tail_size > size) {
+                PutTail(tail + size, tail_size - size);
+            }
+            return tail;
+        }
+    }
+    return nullptr;
+}
+
+static inline unsigned MapBin(std::size_t size) {
+    unsigned bin = 63 - __builtin_clzll(size >> PAGE_SHIFT);
+    return bin < NUM_MAP_BINS ? bin : NUM_MAP_BINS - 1;
+}
+
+/**
+ * Keep a mapping of size bytes for reuse instead of unmapping it, if
+ * the cache has room for it.  Only normal mappings may be put here,
+ * not huge page ones: large objects are resized with mremap.
+ */
+void MemorySingleton::PutMapping(char* mem, std::size_t size, bool dirty) {
+    std::size_t limit = GetSetting(&map_cache_limit, "ATOMIC_MALLOC_MAP_CACHE", ALLOC_MAP_CACHE);
+    if (map_cache_size.fetch_add(size) + size <= limit) {
+        CachedMapping* header = reinterpret_cast<CachedMapping*>(mem);
+        header->size = size;
+        header->dirty = dirty;
+        std::atomic<char*>* slots = map_cache[MapBin(size)];
+        for (unsigned i = 0; i < MAP_SLOTS; ++i) {
+            char* expected = nullptr;
+            if (slots[i].compare_exchange_strong(expected, mem)) {
+                return;
+            }
+        }
+    }
+    map_cache_size.fetch_sub(size);
+    munmap(mem, size);
+}
+
+/**
+ * Take a cached mapping of at least *size bytes and at most twice
+ * that, and store its size in *size and whether it was written to in
+ * *dirty.  The header is zeroed.  Returns nullptr if there is none.
+ */
+char* MemorySingleton::TakeMapping(std::size_t* size, bool* dirty) {
+    if (!map_cache_size.load(std::memory_order_relaxed)) {
+        return nullptr;
+    }
+    unsigned first_bin = MapBin(*size);
+    for (unsigned bin = first_bin; bin < NUM_MAP_BINS && bin <= first_bin + 1; ++bin) {
+        for (unsigned i = 0; i < MAP_SLOTS; ++i) {
+            if (!map_cache[bin][i].load(std::memory_order_relaxed)) {
+                continue;
+            }
+            char* mem = map_cache[bin][i].exchange(nullptr);
+            if (!mem) {
+                continue;
+            }
+            CachedMapping* header = reinterpret_cast<CachedMapping*>(mem);
+            std::size_t mem_size = header->size;
+            if (mem_size < *size || mem_size / 2 > *size) {
+                char* expected = nullptr;
+                if (!map_cache[bin][i].compare_exchange_strong(expected, mem)) {
+                    map_cache_size.fetch_sub(mem_size);
+                    munmap(mem, mem_size);
+                }
+                continue;
+            }
+            map_cache_size.fetch_sub(mem_size);
+            *size = mem_size;
+            *dirty = header->dirty;
+            std::memset(header, 0, sizeof(*header));
+            return mem;
         }
+    }
+    return nullptr;
+}
+
+/**
+ * Unmap a region that was never used, or cache it in normal mode.
+ */
+void MemorySingleton::DropRegion(char* mem, std::size_t size) {
+    sbrk_stat.fetch_sub(size);
+    if (GetHugePageMode() == HUGE_OFF) {
+        PutMapping(mem, size, false);
     } else {
+        munmap(mem, size);
+    }
+}
+
+// Same as LoadRegion: a torn value fails the following CAS.
+static inline TaggedSpan LoadTagged(TaggedSpan* stack) {
+    TaggedSpan cur;
+    cur.tag = __atomic_load_n(&stack->tag, __ATOMIC_ACQUIRE);
+    cur.top = __atomic_load_n(&stack->top, __ATOMIC_ACQUIRE);
+    return cur;
+}
+
+static inline bool CompareExchangeTagged(TaggedSpan* stack, TaggedSpan expected, TaggedSpan desired) {
+    static_assert(sizeof(TaggedSpan) == sizeof(unsigned __int128), "TaggedSpan has to be double-width");
+    unsigned __int128 old_value, new_value;
+    std::memcpy(&old_value, &expected, sizeof(old_value));
+    std::memcpy(&new_value, &desired, sizeof(new_value));
+    return __sync_bool_compare_and_swap(reinterpret_cast<unsigned __int128*>(stack),
+                                        old_value, new_value);
+}
+
+// Bin of the span pool for a span of size bytes; NUM_SPAN_BINS if it
+// is too large to be pooled.  Spans have at least two pages.
+static inline unsigned SpanBin(std::size_t size) {
+    unsigned bin = 63 - __builtin_clzll(size >> PAGE_SHIFT);
+    return bin < NUM_SPAN_BINS ? bin : NUM_SPAN_BINS;
+}
+
+/**
+ * Push a released span onto the stripe of the pool for the heap id.
+ * Past the first page of blocks, the span has to be zeroed.
+ */
+void MemorySingleton::PutSpan(Span* span, unsigned stripe) {
+    TaggedSpan* stack = &span_pool[SpanBin(span->size)][stripe % SPAN_POOL_STRIPES].head;
+    span_pool_size.fetch_add(span->size, std::memory_order_relaxed);
+    pool_put_stat.fetch_add(1, std::memory_order_relaxed);
+    while (true) {
+        TaggedSpan cur = LoadTagged(stack);
+        __atomic_store_n(&span->next_slab, cur.top, __ATOMIC_RELAXED);
+        if (CompareExchangeTagged(stack, cur, TaggedSpan{span, cur.tag + 1})) {
+            return;
+        }
+    }
+}
+
+/**
+ * Pop a pooled span of at least size bytes, from the stripe of the
+ * heap id first, then from the others.  Returns nullptr if there is
+ * none.
+ */
+MemorySingleton::Span* MemorySingleton::TakeSpan(std::size_t size, unsigned stripe) {
+    if (!span_pool_size.load(std::memory_order_relaxed)) {
         return nullptr;
     }
+    // The bin above size unless it is a power of two.
+    std::size_t pages = size >> PAGE_SHIFT;
+    unsigned bin = SpanBin(size) + ((pages & (pages - 1)) != 0);
+    if (bin >= NUM_SPAN_BINS) {
+        return nullptr;
+    }
+    for (unsigned i = 0; i < SPAN_POOL_STRIPES; ++i) {
+        TaggedSpan* stack = &span_pool[bin][(stripe + i) % SPAN_POOL_STRIPES].head;
+        TaggedSpan cur = LoadTagged(stack);
+        while (cur.top) {
+            Span* next = __atomic_load_n(&cur.top->next_slab, __ATOMIC_RELAXED);
+            if (CompareExchangeTagged(stack, cur, TaggedSpan{next, cur.tag + 1})) {
+                span_pool_size.fetch_sub(cur.top->size, std::memory_order_relaxed);
+                pool_take_stat.fetch_add(1, std::memory_order_relaxed);
+                return cur.top;
+            }
+            cur = LoadTagged(stack);
+        }
+    }
+    return nullptr;
 }
 
-void* MemorySingleton::Allocate(std::size_t size) {
-    size = AlignSize(size);
+/**
+ * Map a new region of size bytes, pre-faulting it if populate is set.
+ * In huge page mode, try MAP_HUGETLB first, which needs pages reserved
+ * by the administrator, then an aligned mapping with MADV_HUGEPAGE,
+ * which is a hint only: without transparent huge pages the region is
+ * just backed by normal pages.
+ */
+char* MemorySingleton::MapRegion(std::size_t size, bool populate) {
+    int mode = GetHugePageMode();
+    int populate_flag = populate ? MAP_POPULATE : 0;
+    void* mem;
+    if (mode == HUGE_OFF) {
+        mem = mmap(0, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|populate_flag, -1, 0);
+        return static_cast<char*>(mem);
+    }
+#ifdef MAP_HUGETLB
+    if (mode == HUGE_AUTO) {
+        mem = mmap(0, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB|populate_flag, -1, 0);
+        if (mem != MAP_FAILED) {
+            hugetlb_stat.fetch_add(size / HUGE_PAGE_SIZE);
+            return static_cast<char*>(mem);
+        }
+    }
+#endif
+    mem = mmap(0, size + HUGE_PAGE_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        return static_cast<char*>(mem);
+    }
+    char* raw = static_cast<char*>(mem);
+    char* aligned = reinterpret_cast<char*>(
+        (reinterpret_cast<std::uintptr_t>(raw) + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+    if (aligned != raw) {
+        munmap(raw, aligned - raw);
+    }
+    munmap(aligned + size, raw + HUGE_PAGE_SIZE - aligned);
+#ifdef MADV_HUGEPAGE
+    madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+    if (populate) {
+        // After the advice, so that the faults get huge pages.
+        for (char* page = aligned; page < aligned + size; page += PAGE_SIZE) {
+            *reinterpret_cast<volatile char*>(page) = 0;
+        }
+    }
+    return aligned;
+}
+
+static inline void FutexWait(std::atomic<int>* word, int value) {
+    syscall(SYS_futex, reinterpret_cast<int*>(word), FUTEX_WAIT_PRIVATE, value, nullptr, nullptr, 0);
+}
+
+static inline void FutexWake(std::atomic<int>* word) {
+    syscall(SYS_futex, reinterpret_cast<int*>(word), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+}
+
+/**
+ * Body of the premap thread: whenever asked, map the next region and
+ * leave it in premapped.
+ */
+void* MemorySingleton::PremapLoop(void*) {
+    bool populate = GetSetting(&premap_mode, "ATOMIC_MALLOC_PREMAP", ALLOC_PREMAP) == PREMAP_POPULATE;
     while (true) {
-        char* end = free_end.load();
-        // Order of fetching end and start is important 8-)>
-        // If AllocSbrk will happen before fetching end and start,
-        // end < start, and the loop will just restart immediately.
-        // If you change order of these statements, it will be
-        // start < end, but start and end will be from different
-        // memory regions...
-        char* start = free_begin.load();
-
-        // It REALLY affects sbrk size!
-        if (end && start > end) {
-            continue;
+        while (!premap_wanted.load()) {
+            FutexWait(&premap_wanted, 0);
         }
-            
-        //std::cerr << (void*)start << " -> " << (void*)end << std::endl;
-        if (end && (start + size <= end)) {
-            /* ^ We check here for "end" because it is
-             * initialized/updated last */
+        if (!premapped.load()) {
+            std::size_t size = SbrkAllocSize(0);
+            char* mem = MapRegion(size, populate);
+            if (mem != MAP_FAILED) {
+                sbrk_stat.fetch_add(size);
+                UpdatePeak();
+                premap_stat.fetch_add(1);
+                premapped_size.store(size);
+                premapped.store(mem);
+            }
+        }
+        premap_wanted.store(0);
+    }
+    return nullptr;
+}
 
-            char* new_start = start + size;
-            if (free_begin.compare_exchange_weak(start, new_start)) {
-                alloc_stat.fetch_add(size);
-                return start;
+/**
+ * Start the premap thread if ATOMIC_MALLOC_PREMAP (or ALLOC_PREMAP)
+ * asks for it.  Called by the library constructor, as creating a
+ * thread from inside malloc would reenter it.
+ */
+void MemorySingleton::StartPremap() {
+    if (GetSetting(&premap_mode, "ATOMIC_MALLOC_PREMAP", ALLOC_PREMAP) == PREMAP_OFF
+        || premap_running.exchange(true)) {
+        return;
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, nullptr, PremapLoop, nullptr) == 0) {
+        pthread_detach(thread);
+    } else {
+        premap_running.store(false);
+    }
+}
+
+/**
+ * Wake the premap thread when the free part of the region drops below
+ * a quarter of the next region.
+ */
+static inline void CheckLowWater(std::size_t free_size) {
+    if (premap_running.load(std::memory_order_relaxed)
+        && free_size < SbrkAllocSize(0) / 4
+        && !premapped.load(std::memory_order_relaxed)
+        && !premap_wanted.load(std::memory_order_relaxed)
+        && !premap_wanted.exchange(1)) {
+        FutexWake(&premap_wanted);
+    }
+}
+
+/**
+ * Read the region descriptor.  The halves are loaded separately and
+ * may come from different regions; such a torn value just makes the
+ * following CompareExchangeRegion fail.
+ */
+MemorySingleton::Region MemorySingleton::LoadRegion() {
+    Region cur;
+    cur.end = __atomic_load_n(&region.end, __ATOMIC_ACQUIRE);
+    cur.begin = __atomic_load_n(&region.begin, __ATOMIC_ACQUIRE);
+    return cur;
+}
+
+bool MemorySingleton::CompareExchangeRegion(Region expected, Region desired) {
+    static_assert(sizeof(Region) == sizeof(unsigned __int128), "Region has to be double-width");
+    unsigned __int128 old_value, new_value;
+    std::memcpy(&old_value, &expected, sizeof(old_value));
+    std::memcpy(&new_value, &desired, sizeof(new_value));
+    return __sync_bool_compare_and_swap(reinterpret_cast<unsigned __int128*>(&region),
+                                        old_value, new_value);
+}
+
+/**
+ * Map a new region and install it in place of cur, allocating size
+ * bytes from it.  Other threads keep allocating meanwhile; if one of
+ * them installs a region that fits the request first, ours is unmapped
+ * and nullptr is returned to retry.
+ */
+char* MemorySingleton::AllocSbrk(std::size_t size, Region cur) {
+    // With a premapped region, this is just a pointer swap.
+    char* sbrk_new = premapped.load() ? premapped.exchange(nullptr) : nullptr;
+    size_t allocSize = sbrk_new ? premapped_size.load() : 0;
+    if (sbrk_new && allocSize < size) {
+        DropRegion(sbrk_new, allocSize);
+        sbrk_new = nullptr;
+    }
+    if (!sbrk_new) {
+        allocSize = SbrkAllocSize(size);
+        bool dirty = false;
+        // Huge page regions have to be aligned, cached mappings are not.
+        sbrk_new = GetHugePageMode() == HUGE_OFF ? TakeMapping(&allocSize, &dirty) : nullptr;
+        if (sbrk_new) {
+            // Regions have to be zeroed; one syscall instead of two.
+            if (dirty) {
+                madvise(sbrk_new, allocSize, MADV_DONTNEED);
+            }
+        } else {
+            //std::cerr << "Sbrk size " << allocSize << " for " << size << std::endl;
+            sbrk_new = MapRegion(allocSize, false);
+            if (sbrk_new == reinterpret_cast<void*>(-1)) {
+                throw std::runtime_error("OOM");
+            }
+        }
+        sbrk_stat.fetch_add(allocSize);
+        UpdatePeak();
+    }
+    assert((((intptr_t)sbrk_new) & (ALIGN_SIZE - 1)) == 0);
+
+    char* start = sbrk_new;
+    Region installed{start + size, sbrk_new + allocSize};
+    while (!CompareExchangeRegion(cur, installed)) {
+        cur = LoadRegion();
+        if (cur.Free() >= size) {
+            DropRegion(sbrk_new, allocSize);
+            return nullptr;
+        }
+    }
+    GrowRegionSize(allocSize);
+    // Nobody can allocate from the old region anymore.
+    if (cur.Free()) {
+        PutTail(cur.begin, cur.Free());
+    }
+    return start;
+}
+
+/**
+ * Allocate size bytes from the shared region.  Sizes are whole pages,
+ * so that everything carved from the region stays page-aligned.
+ */
+char* MemorySingleton::AllocateShared(std::size_t size) {
+    assert(size % PAGE_SIZE == 0);
+    while (true) {
+        Region cur = LoadRegion();
+        if (cur.Free() >= size) {
+            if (CompareExchangeRegion(cur, Region{cur.begin + size, cur.end})) {
+                CheckLowWater(cur.Free() - size);
+                return cur.begin;
             }
             // else continue;
         } else {
+            char* start = TakeTail(size);
+            if (start) {
+                return start;
+            }
             //std::cerr << "Try sbrk" << std::endl;
-            start = AllocSbrk(size);
-            
+            start = AllocSbrk(size, cur);
             if (start) {
-                alloc_stat.fetch_add(size);
                 return start;
             }
             // else continue;
@@ -110,9 +1054,1134 @@ void* MemorySingleton::Allocate(std::size_t size) {
     }
 }
 
+/**
+ * Give the calling thread a heap: an abandoned one if there is any,
+ * else a new one allocated from the shared region.  When all ids are
+ * taken, a new heap gets id 0, and its blocks have no owner.
+ */
+MemorySingleton::ThreadHeap* MemorySingleton::CreateHeap() {
+    pthread_once(&heap_key_once, []() { pthread_key_create(&heap_key, AbandonHeap); });
+    // Heaps are never removed from the list, so it is safe to walk.
+    ThreadHeap* heap = all_heaps.load(std::memory_order_acquire);
+    while (heap && !(heap->abandoned.load(std::memory_order_relaxed)
+                     && heap->abandoned.exchange(false, std::memory_order_acquire))) {
+        heap = heap->next_heap;
+    }
+
+    if (!heap) {
+        // The region is fresh from mmap, hence zeroed.
+        heap = reinterpret_cast<ThreadHeap*>(AllocateShared(PageRound(sizeof(ThreadHeap))));
+
+        unsigned id = heap_count.fetch_add(1) + 1;
+        if (id < MAX_HEAPS) {
+            heap->id = id;
+            heaps[id].store(heap);
+        }
+        heap->next_heap = all_heaps.load();
+        while (!all_heaps.compare_exchange_weak(heap->next_heap, heap)) {
+        }
+    }
+    // Before pthread_setspecific, which may allocate.
+    thread_heap = heap;
+    pthread_setspecific(heap_key, heap);
+    return heap;
+}
+
+/**
+ * Thread exit hook: hand the pending chain to its owner, then leave
+ * the heap with its spans and free lists to the next thread, which
+ * keeps bumping the spans under the same owner id.  Blocks freed later
+ * by this thread, e.g. by __libc_thread_freeres after all destructors,
+ * go straight to their owners, see FreeExited.  Only an allocation
+ * gets it a heap again, and then the hook runs again if it can.
+ */
+void MemorySingleton::AbandonHeap(void* ptr) {
+    thread_heap = nullptr;
+    thread_exited = true;
+    ReleaseHeap(static_cast<ThreadHeap*>(ptr));
+}
+
+/**
+ * Nobody looks at the purge queue of an abandoned heap until it is
+ * adopted, which may be never, so its free spans are purged and go to
+ * the span pool now, whatever their decay.
+ */
+void MemorySingleton::ReleaseHeap(ThreadHeap* heap) {
+    FlushRemote(heap);
+    DrainRemote(heap);
+    if (heap->purge_head) {
+        PurgeSpans(heap, NowMillis(), true);
+    }
+    heap->abandoned.store(true, std::memory_order_release);
+}
+
+/**
+ * Child side of fork: only the forking thread survives, and the premap
+ * thread is gone; the child maps its regions itself.
+ *
+ * The heaps of the other threads are dropped: they stay in use and are
+ * never adopted.  A thread may have been stopped by fork halfway
+ * through an update of its heap (a bump span, the pending chain, a
+ * bitmap and its free count), so the copy cannot be trusted.  Their
+ * spans and free blocks are leaked, and blocks the child frees into
+ * them wait on remote lists that are never drained.  Heaps that were
+ * abandoned before are consistent and are adopted as usual.
+ *
+ * Nothing is ever locked, so there is nothing to prepare in the parent
+ * or to restore after it: the shared structures are only changed with
+ * single atomic steps, and a thread stopped between two of them leaves
+ * at most the block, span or tail it held unreachable.
+ */
+void MemorySingleton::ForkChild() {
+    premap_wanted.store(0);
+    premap_running.store(false);
+}
+
+void MemorySingleton::RegisterForkHandlers() {
+    pthread_atfork(nullptr, nullptr, ForkChild);
+}
+
+inline MemorySingleton::ThreadHeap* MemorySingleton::LocalHeap() {
+    ThreadHeap* heap = thread_heap;
+    return heap ? heap : CreateHeap();
+}
+
+/**
+ * Peak of the memory mapped by the allocator; updated whenever the
+ * mapped size grows, which is rare.
+ */
+void MemorySingleton::UpdatePeak() {
+    std::size_t footprint = sbrk_stat.load() + mmap_stat.load() + arena_stat.load()
+        + map_cache_size.load();
+    std::size_t peak = peak_stat.load();
+    while (footprint > peak && !peak_stat.compare_exchange_weak(peak, footprint)) {
+    }
+}
+
+#ifdef ALLOC_HAVE_RSEQ
+/*
+ * Restartable sequences: the kernel aborts a sequence that is
+ * preempted or migrated before its final store, the commit, and
+ * resumes at its abort handler.  A sequence that reaches the commit
+ * ran alone on its CPU, so per-CPU data needs no atomics.
+ *
+ * Each sequence starts at 1 and commits right before 2; 3 is its
+ * descriptor, 4 its abort handler, preceded by the signature, and 5
+ * the common exit.
+ */
+#define RSEQ_STR_(x) #x
+#define RSEQ_STR(x) RSEQ_STR_(x)
+#define RSEQ_ENTER                                                     \
+    ".pushsection __rseq_cs, \"aw\"\n\t"                                \
+    ".balign 32\n\t"                                                   \
+    "3:\n\t"                                                           \
+    ".long 0, 0\n\t"                                                   \
+    ".quad 1f, 2f - 1f, 4f\n\t"                                         \
+    ".popsection\n\t"                                                  \
+    "leaq 3b(%%rip), %%rax\n\t"                                        \
+    "movq %%rax, %[rseq_cs]\n\t"                                       \
+    "1:\n\t"                                                           \
+    "cmpl %[cpu], %[cpu_id]\n\t"                                       \
+    "jnz 4f\n\t"
+#define RSEQ_ABORT(handler)                                            \
+    ".pushsection __rseq_failure, \"ax\"\n\t"                           \
+    ".byte 0x0f, 0xb9, 0x3d\n\t"                                       \
+    ".long " RSEQ_STR(RSEQ_SIG) "\n\t"                                 \
+    "4:\n\t"                                                           \
+    handler                                                            \
+    "jmp 5f\n\t"                                                       \
+    ".popsection\n\t"                                                  \
+    "5:\n\t"
+
+// Returned by RseqPop for an aborted sequence; blocks are aligned, so
+// it is never a block.
+static FreeBlock* const RSEQ_ABORTED = reinterpret_cast<FreeBlock*>(1);
+
+static inline struct rseq* RseqArea() {
+    char* thread_pointer;
+    asm("movq %%fs:0, %0" : "=r"(thread_pointer));
+    return reinterpret_cast<struct rseq*>(thread_pointer + __rseq_offset);
+}
+
+// Pop the head of list, which belongs to cpu.  Returns nullptr if the
+// list is empty, RSEQ_ABORTED to retry.
+static inline FreeBlock* RseqPop(struct rseq* rs, unsigned cpu, FreeBlock** list) {
+    FreeBlock* head;
+    asm volatile(
+        RSEQ_ENTER
+        "movq %[list], %[head]\n\t"
+        "testq %[head], %[head]\n\t"
+        "jz 5f\n\t"
+        "movq (%[head]), %%rax\n\t"
+        "movq %%rax, %[list]\n\t"
+        "2:\n\t"
+        RSEQ_ABORT("movq $1, %[head]\n\t")
+        : [head] "=&r"(head), [list] "+m"(*list), [rseq_cs] "=m"(rs->rseq_cs)
+        : [cpu] "r"(cpu), [cpu_id] "m"(rs->cpu_id)
+        : "rax", "memory", "cc");
+    return head;
+}
+
+// Push the chain first..last onto list, which belongs to cpu.  Returns
+// false to retry.
+static inline bool RseqPush(struct rseq* rs, unsigned cpu, FreeBlock** list,
+                            FreeBlock* first, FreeBlock* last) {
+    int done;
+    asm volatile(
+        RSEQ_ENTER
+        "movq %[list], %%rax\n\t"
+        "movq %%rax, (%[last])\n\t"
+        "movq %[first], %[list]\n\t"
+        "2:\n\t"
+        "movl $1, %[done]\n\t"
+        "jmp 5f\n\t"
+        RSEQ_ABORT("movl $0, %[done]\n\t")
+        : [done] "=&r"(done), [list] "+m"(*list), [rseq_cs] "=m"(rs->rseq_cs)
+        : [cpu] "r"(cpu), [cpu_id] "m"(rs->cpu_id), [first] "r"(first), [last] "r"(last)
+        : "rax", "memory", "cc");
+    return done;
+}
+
+/**
+ * Number of possible CPUs, from /sys/devices/system/cpu/possible
+ * ("0-63" or a list of ranges), read with plain syscalls as
+ * sysconf may allocate.  0 if unknown.
+ */
+static unsigned PossibleCpus() {
+    char buf[256];
+    int fd = open("/sys/devices/system/cpu/possible", O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0) {
+        return 0;
+    }
+    buf[len] = 0;
+    // The last number is the highest CPU.
+    const char* last = nullptr;
+    for (const char* p = buf; *p; ++p) {
+        if (*p >= '0' && *p <= '9' && (p == buf || p[-1] < '0' || p[-1] > '9')) {
+            last = p;
+        }
+    }
+    return last ? strtoul(last, nullptr, 10) + 1 : 0;
+}
+#endif
+
+/**
+ * Whether blocks are cached per CPU: asked for, and rseq is registered
+ * by glibc.
+ */
+static inline bool PerCpuMode() {
+#ifdef ALLOC_HAVE_RSEQ
+    return GetSetting(&per_cpu_mode, "ATOMIC_MALLOC_PERCPU", ALLOC_PERCPU) && __rseq_size;
+#else
+    return false;
+#endif
+}
+
+/**
+ * Per-CPU caches, allocated from the shared region on first use.  The
+ * loser of a race returns its copy to the tail pool.
+ */
+MemorySingleton::CpuCache* MemorySingleton::CpuCaches() {
+    CpuCache* caches = cpu_caches.load(std::memory_order_acquire);
+    if (caches) {
+        return caches;
+    }
+#ifdef ALLOC_HAVE_RSEQ
+    unsigned count = PossibleCpus();
+    if (!count) {
+        return nullptr;
+    }
+    std::size_t size = PageRound(count * sizeof(CpuCache));
+    char* mem = AllocateShared(size);
+    // Fresh from mmap, hence zeroed.
+    CpuCache* fresh = reinterpret_cast<CpuCache*>(mem);
+    cpu_count.store(count);
+    if (cpu_caches.compare_exchange_strong(caches, fresh)) {
+        return fresh;
+    }
+    PutTail(mem, size);
+#endif
+    return caches;
+}
+
+/**
+ * Per-CPU path of Allocate: pop the free list of the current CPU, or
+ * bump a batch of blocks from the span of the heap, return the first
+ * one and put the rest on the list.  *fresh is set if the block is
+ * bumped, hence zeroed.  Returns nullptr if the thread cannot use the
+ * per-CPU caches.
+ */
+void* MemorySingleton::AllocateCpu(ThreadHeap* heap, unsigned cls, bool* fresh) {
+#ifdef ALLOC_HAVE_RSEQ
+    CpuCache* caches = CpuCaches();
+    if (!caches) {
+        return nullptr;
+    }
+    struct rseq* rs = RseqArea();
+    unsigned cpu;
+    FreeBlock* head;
+    do {
+        cpu = __atomic_load_n(&rs->cpu_id, __ATOMIC_RELAXED);
+        if (cpu >= cpu_count.load(std::memory_order_relaxed)) {
+            // Not registered for this thread.
+            return nullptr;
+        }
+        head = RseqPop(rs, cpu, &caches[cpu].free_lists[cls]);
+    } while (head == RSEQ_ABORTED);
+    if (head) {
+        *fresh = false;
+        return head;
+    }
+
+    std::size_t size = ClassSize(cls);
+    std::size_t count = std::max(std::size_t(1), CPU_REFILL_SIZE / size);
+    char* start = BumpBlocks(heap, cls, &count);
+    if (count > 1) {
+        FreeBlock* first = reinterpret_cast<FreeBlock*>(start + size);
+        FreeBlock* last = first;
+        for (std::size_t i = 2; i < count; ++i) {
+            last->next = reinterpret_cast<FreeBlock*>(start + i * size);
+            last = last->next;
+        }
+        do {
+            cpu = __atomic_load_n(&rs->cpu_id, __ATOMIC_RELAXED);
+        } while (!RseqPush(rs, cpu, &caches[cpu].free_lists[cls], first, last));
+    }
+    *fresh = true;
+    return start;
+#else
+    (void)heap;
+    (void)cls;
+    (void)fresh;
+    return nullptr;
+#endif
+}
+
+/**
+ * Per-CPU path of Free: push the block onto the free list of the
+ * current CPU, whichever thread or CPU allocated it.  Returns false if
+ * the thread cannot use the per-CPU caches.
+ */
+bool MemorySingleton::FreeCpu(void* ptr, unsigned cls) {
+#ifdef ALLOC_HAVE_RSEQ
+    CpuCache* caches = cpu_caches.load(std::memory_order_acquire);
+    if (!caches) {
+        return false;
+    }
+    struct rseq* rs = RseqArea();
+    FreeBlock* block = static_cast<FreeBlock*>(ptr);
+    unsigned cpu;
+    do {
+        cpu = __atomic_load_n(&rs->cpu_id, __ATOMIC_RELAXED);
+        if (cpu >= cpu_count.load(std::memory_order_relaxed)) {
+            return false;
+        }
+    } while (!RseqPush(rs, cpu, &caches[cpu].free_lists[cls], block, block));
+    return true;
+#else
+    (void)ptr;
+    (void)cls;
+    return false;
+#endif
+}
+
+// Push the chain from first to last onto the remote list of the heap.
+static void PushRemote(MemorySingleton::ThreadHeap* owner, FreeBlock* first, FreeBlock* last) {
+    FreeBlock* head = owner->remote_free.load(std::memory_order_relaxed);
+    do {
+        last->next = head;
+    } while (!owner->remote_free.compare_exchange_weak(
+                 head, first, std::memory_order_release, std::memory_order_relaxed));
+}
+
+/**
+ * Hand the pending chain over to its owner with a single CAS.
+ */
+void MemorySingleton::FlushRemote(ThreadHeap* heap) {
+    if (!heap->pending_head) {
+        return;
+    }
+    PushRemote(heaps[heap->pending_owner].load(std::memory_order_acquire),
+               heap->pending_head, heap->pending_tail);
+    heap->pending_head = nullptr;
+    heap->pending_tail = nullptr;
+    heap->pending_count = 0;
+}
+
+/**
+ * Mark all blocks freed by other threads in their slabs.  Returns
+ * false if there were none.
+ */
+bool MemorySingleton::DrainRemote(ThreadHeap* heap) {
+    if (!heap->remote_free.load(std::memory_order_relaxed)) {
+        return false;
+    }
+    FreeBlock* block = heap->remote_free.exchange(nullptr, std::memory_order_acquire);
+    while (block) {
+        FreeBlock* next = block->next;
+        // Only blocks of spans of this heap get here.
+        FreeSlot(heap, FindSpan(block), block);
+        block = next;
+    }
+    return true;
+}
+
+/**
+ * Mark the block at ptr in the slab bitmap of its span, which belongs
+ * to the heap, and put the span on the slab list of the heap if it had
+ * no freed slot yet.
+ */
+inline void MemorySingleton::FreeSlot(ThreadHeap* heap, Span* span, void* ptr) {
+    std::size_t slot = SlotIndex(span, ptr);
+    std::size_t word = slot / 64;
+    std::uint64_t bit = std::uint64_t(1) << (slot % 64);
+    std::uint64_t* bitmap = SlabBitmap(span);
+    assert(!(bitmap[word] & bit));
+    bitmap[word] |= bit;
+    if (word < span->first_word) {
+        span->first_word = word;
+    }
+    if (!span->free_slots++) {
+        span->next_slab = heap->slabs[span->cls];
+        heap->slabs[span->cls] = span;
+    }
+    if (span->free_slots == BumpedSlots(heap, span)) {
+        QueuePurge(heap, span);
+    }
+}
+
+/**
+ * Take the lowest freed slot of the first slab of the class, which has
+ * to exist: skip empty bitmap words, then count the trailing zeros of
+ * the first non-empty one (bsf, or tzcnt where the target has BMI).  A
+ * span that runs out of freed slots leaves the slab list.
+ */
+inline void* MemorySingleton::AllocateSlot(ThreadHeap* heap, unsigned cls) {
+    Span* span = heap->slabs[cls];
+    std::uint64_t* bitmap = SlabBitmap(span);
+    std::size_t word = span->first_word;
+    while (!bitmap[word]) {
+        ++word;
+    }
+    std::size_t slot = word * 64 + __builtin_ctzll(bitmap[word]);
+    bitmap[word] &= bitmap[word] - 1;
+    span->first_word = word;
+    if (!--span->free_slots) {
+        heap->slabs[cls] = span->next_slab;
+    }
+    return SpanBlocks(span) + slot * ClassSize(cls);
+}
+
+/**
+ * Number of blocks ever bumped from a small span of the heap: up to
+ * the bump pointer for the span the heap bumps, else all of them.
+ */
+inline std::size_t MemorySingleton::BumpedSlots(ThreadHeap* heap, Span* span) {
+    char* end = reinterpret_cast<char*>(span) + span->size;
+    return SlotIndex(span, heap->end[span->cls] == end ? heap->begin[span->cls] : end);
+}
+
+/**
+ * Queue a span of the heap that just became completely free to be
+ * purged and released once it stayed so for the decay interval, and
+ * purge the spans whose time has come.  One that is reused and freed
+ * again meanwhile keeps its place with a new free time, and only every
+ * PURGE_CHECK_EVENTS-th time looks at the queue.
+ */
+void MemorySingleton::QueuePurge(ThreadHeap* heap, Span* span) {
+    std::uint32_t now = NowMillis();
+    span->free_time = now;
+    if (span->purge_state != PURGE_IDLE) {
+        span->purge_state = PURGE_REFRESHED;
+        if (++heap->purge_events % PURGE_CHECK_EVENTS == 0) {
+            PurgeSpans(heap, now);
+        }
+        return;
+    }
+    span->purge_state = PURGE_QUEUED;
+    span->next_purge = nullptr;
+    if (heap->purge_tail) {
+        heap->purge_tail->next_purge = span;
+    } else {
+        heap->purge_head = span;
+    }
+    heap->purge_tail = span;
+    PurgeSpans(heap, now);
+}
+
+/**
+ * Release the block pages of the queued spans that became free at
+ * least the decay interval before now, or at all if all is set, and
+ * still are, unless purging is off.  Spans in use again just leave the
+ * queue, and refreshed ones that are not due yet go back to its tail.
+ * The queue is looked at up to the first other span that is not due.
+ * The page with the descriptor and the bitmap stays.  A span the heap
+ * does not bump then goes to the span pool for any thread to reuse,
+ * marked dirty unless MADV_DONTNEED zeroed all of it but the first
+ * page.  The span the heap bumps stays with its slots free, and reusing
+ * them faults the pages back in.
+ */
+void MemorySingleton::PurgeSpans(ThreadHeap* heap, std::uint32_t now, bool all) {
+    long mode = GetSetting(&purge_mode, "ATOMIC_MALLOC_PURGE", ALLOC_PURGE);
+    int advice = mode == PURGE_DONTNEED ? MADV_DONTNEED : MADV_FREE;
+    std::uint32_t decay = GetSetting(&purge_decay, "ATOMIC_MALLOC_PURGE_DECAY", ALLOC_PURGE_DECAY);
+    Span* released = nullptr;
+    Span* span;
+    while ((span = heap->purge_head)) {
+        std::size_t bumped = BumpedSlots(heap, span);
+        bool still_free = span->free_slots == bumped;
+        if (still_free && !all && now - span->free_time < decay) {
+            if (span->purge_state != PURGE_REFRESHED || span == heap->purge_tail) {
+                break;
+            }
+            heap->purge_head = span->next_purge;
+            span->purge_state = PURGE_QUEUED;
+            span->next_purge = nullptr;
+            heap->purge_tail->next_purge = span;
+            heap->purge_tail = span;
+            continue;
+        }
+        heap->purge_head = span->next_purge;
+        if (!heap->purge_head) {
+            heap->purge_tail = nullptr;
+        }
+        span->purge_state = PURGE_IDLE;
+        if (!still_free) {
+            continue;
+        }
+        char* first = SpanBlocks(span);
+        char* start = first + (PAGE_SIZE - reinterpret_cast<std::uintptr_t>(first) % PAGE_SIZE) % PAGE_SIZE;
+        char* end = reinterpret_cast<char*>(
+            PageRound(reinterpret_cast<std::uintptr_t>(first + bumped * ClassSize(span->cls))));
+        bool zeroed = advice == MADV_DONTNEED;
+        if (mode != PURGE_OFF && start < end) {
+            if (madvise(start, end - start, advice) == 0) {
+                purge_stat.fetch_add(end - start, std::memory_order_relaxed);
+            } else {
+                zeroed = false;
+            }
+        }
+        char* span_end = reinterpret_cast<char*>(span) + span->size;
+        if (heap->end[span->cls] != span_end && SpanBin(span->size) < NUM_SPAN_BINS) {
+            span->dirty = mode == PURGE_OFF || !zeroed;
+            span->released = true;
+            span->next_purge = released;
+            released = span;
+        }
+    }
+    if (released) {
+        ReleaseSpans(heap, released);
+    }
+}
 
+/**
+ * Hand the released spans, linked by next_purge, over to the span
+ * pool.  They leave the slab lists of the heap first, in one pass over
+ * the list of each class involved.
+ */
+void MemorySingleton::ReleaseSpans(ThreadHeap* heap, Span* released) {
+    for (Span* span = released; span; span = span->next_purge) {
+        Span** link = &heap->slabs[span->cls];
+        if (span->free_slots == 0) {
+            // Its list was already filtered.
+            continue;
+        }
+        while (*link) {
+            if ((*link)->released) {
+                (*link)->free_slots = 0;
+                *link = (*link)->next_slab;
+            } else {
+                link = &(*link)->next_slab;
+            }
+        }
+    }
+    while (released) {
+        // Once pushed, the span may be taken and reused at any time.
+        Span* next = released->next_purge;
+        PutSpan(released, heap->id);
+        released = next;
+    }
+}
+
+/**
+ * Replace the span of the class the heap bumps with a fresh one, of at
+ * least size bytes of blocks, and allocate size bytes from it.  Less
+ * than a block is left of the old span.
+ */
+char* MemorySingleton::RefillSpan(ThreadHeap* heap, unsigned cls, std::size_t size) {
+    // A good moment to release blocks that wait for their owner, and
+    // pages that wait for the kernel.
+    FlushRemote(heap);
+    if (heap->purge_head) {
+        PurgeSpans(heap, NowMillis());
+    }
+    std::size_t block_size = ClassSize(cls);
+    std::size_t span_size = SpanSize(cls, size);
+    Span* span = TakeSpan(span_size, heap->id);
+    if (span) {
+        // Unless all of it is dirty, only the descriptor, the bitmap
+        // and the blocks before the first purged page are.  The page
+        // map stays.
+        span_size = span->size;
+        std::uintptr_t clean = span->dirty ? reinterpret_cast<std::uintptr_t>(span) + span_size
+            : PageRound(reinterpret_cast<std::uintptr_t>(SpanBlocks(span)));
+        std::memset(static_cast<void*>(span), 0, clean - reinterpret_cast<std::uintptr_t>(span));
+    } else {
+        // Fresh from mmap or from the tail pool, hence zeroed, bitmap
+        // and all.
+        span = reinterpret_cast<Span*>(AllocateShared(span_size));
+        if (!SetPageMap(reinterpret_cast<char*>(span), span_size, span)) {
+            throw std::runtime_error("OOM");
+        }
+    }
+    span->size = span_size;
+    span->cls = cls;
+    span->owner = heap->id;
+    span->block_offset = SlabHeaderSize(span_size, block_size);
+    span->reciprocal = UINT64_MAX / block_size + 1;
+    char* start = SpanBlocks(span);
+    heap->begin[cls] = start + size;
+    heap->end[cls] = reinterpret_cast<char*>(span) + span_size;
+    return start;
+}
+
+/**
+ * Bump up to *count blocks of the class from the span of the heap,
+ * refilling it if it is full, and store the number of blocks taken in
+ * *count.  Returns the first one; the rest follow it.
+ */
+char* MemorySingleton::BumpBlocks(ThreadHeap* heap, unsigned cls, std::size_t* count) {
+    std::size_t size = ClassSize(cls);
+    char* start = heap->begin[cls];
+    std::size_t room = (heap->end[cls] - start) / size;
+    if (!room) {
+        return RefillSpan(heap, cls, *count * size);
+    }
+    *count = std::min(*count, room);
+    heap->begin[cls] = start + *count * size;
+    return start;
+}
+
+/**
+ * Map a large object directly, or reuse a cached mapping, which is
+ * zeroed if zero is set.  Unlike the shared region, running out of
+ * address space is a normal outcome for a huge request, so it returns
+ * nullptr instead of throwing.
+ */
+void* MemorySingleton::AllocateLarge(std::size_t size, bool zero) {
+    if (size > SIZE_MAX - SPAN_HEADER_SIZE - PAGE_SIZE) {
+        return nullptr;
+    }
+    std::size_t map_size = PageRound(size + SPAN_HEADER_SIZE);
+    bool dirty = false;
+    void* mem = TakeMapping(&map_size, &dirty);
+    if (mem) {
+        // The old descriptor has to go in any case.
+        std::memset(mem, 0, dirty && zero ? SPAN_HEADER_SIZE + size : SPAN_HEADER_SIZE);
+    } else {
+        mem = mmap(0, map_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            return nullptr;
+        }
+    }
+    Span* span = static_cast<Span*>(mem);
+    span->size = map_size;
+    span->cls = LARGE_CLASS;
+    span->block_offset = SPAN_HEADER_SIZE;
+    if (!SetPageMap(static_cast<char*>(mem), map_size, span)) {
+        munmap(mem, map_size);
+        return nullptr;
+    }
+    ThreadHeap* heap = LocalHeap();
+    Count(heap->alloc_bytes, map_size);
+    Count(heap->alloc_count[NUM_CLASSES], 1);
+    mmap_stat.fetch_add(map_size);
+    UpdatePeak();
+    return SpanBlocks(span);
+}
+
+void MemorySingleton::FreeLarge(Span* span) {
+    std::size_t map_size = span->size;
+    // The heap only counts; a thread without one does not get one.
+    ThreadHeap* heap = thread_heap;
+    if (heap) {
+        Count(heap->free_bytes, map_size);
+        Count(heap->free_count[NUM_CLASSES], 1);
+    }
+    mmap_stat.fetch_sub(map_size);
+    // Before the pages can be mapped again by someone else.
+    SetPageMap(reinterpret_cast<char*>(span), map_size, nullptr);
+    PutMapping(reinterpret_cast<char*>(span), map_size, true);
+}
+
+/**
+ * Allocate a small object, and set *fresh if its block was never
+ * handed out before, which means it is zeroed: bump memory of a span
+ * is.  Blocks that were freed are not.
+ */
+inline void* MemorySingleton::AllocateSmall(std::size_t size, bool* fresh) {
+    unsigned cls = SizeClass(size);
+    size = ClassSize(cls);
+
+    ThreadHeap* heap = LocalHeap();
+    Count(heap->alloc_bytes, size);
+    Count(heap->alloc_count[cls], 1);
+    if (PerCpuMode()) {
+        void* ptr = AllocateCpu(heap, cls, fresh);
+        if (ptr) {
+            return ptr;
+        }
+    }
+    *fresh = false;
+    FreeBlock* head = heap->free_lists[cls];
+    if (head) {
+        heap->free_lists[cls] = head->next;
+        return head;
+    }
+    if (heap->slabs[cls] || (DrainRemote(heap) && heap->slabs[cls])) {
+        return AllocateSlot(heap, cls);
+    }
+
+    *fresh = true;
+    char* start = heap->begin[cls];
+    if (static_cast<std::size_t>(heap->end[cls] - start) >= size) {
+        heap->begin[cls] = start + size;
+        return start;
+    }
+    return RefillSpan(heap, cls, size);
+}
+
+void* MemorySingleton::Allocate(std::size_t size) {
+    if (size > MAX_SMALL_SIZE) {
+        return AllocateLarge(size);
+    }
+    bool fresh;
+    return AllocateSmall(size, &fresh);
+}
+
+/**
+ * Allocate count objects of size bytes into out.  Free blocks and
+ * freed slots of the class are taken first; the rest is bumped from
+ * the span of the thread, and what does not fit from a single fresh
+ * span.
+ * Returns the number of objects allocated, which is less than count
+ * only if large objects run out of address space.
+ */
+std::size_t MemorySingleton::AllocateBatch(std::size_t size, std::size_t count, void** out) {
+    if (size > MAX_SMALL_SIZE) {
+        for (std::size_t i = 0; i < count; ++i) {
+            out[i] = AllocateLarge(size);
+            if (!out[i]) {
+                return i;
+            }
+        }
+        return count;
+    }
+
+    unsigned cls = SizeClass(size);
+    size = ClassSize(cls);
+    // Leaves room for the span header and page rounding.
+    if (count > SIZE_MAX / 4 / size) {
+        return 0;
+    }
+
+    ThreadHeap* heap = LocalHeap();
+    Count(heap->alloc_bytes, size * count);
+    Count(heap->alloc_count[cls], count);
+    std::size_t n = 0;
+    FreeBlock* head = heap->free_lists[cls];
+    while (head && n < count) {
+        out[n++] = head;
+        head = head->next;
+    }
+    heap->free_lists[cls] = head;
+    if (n < count && !heap->slabs[cls]) {
+        DrainRemote(heap);
+    }
+    while (n < count && heap->slabs[cls]) {
+        out[n++] = AllocateSlot(heap, cls);
+    }
+
+    while (n < count) {
+        std::size_t bumped = count - n;
+        char* start = BumpBlocks(heap, cls, &bumped);
+        for (std::size_t i = 0; i < bumped; ++i, start += size) {
+            out[n++] = start;
+        }
+    }
+    return count;
+}
+
+/**
+ * Mark the block as free in the slab of its span if the span is ours.
+ * Blocks of other heaps are batched per owner, see FlushRemote; blocks
+ * without an owner go onto the free list of their class.
+ */
+void MemorySingleton::Free(void* ptr) {
+    if (!ptr) {
+        return;
+    }
+    Span* span = FindSpan(ptr);
+    if (!span) {
+        // Not allocated by us.
+        return;
+    }
+    unsigned cls = span->cls;
+    if (cls == LARGE_CLASS) {
+        FreeLarge(span);
+        return;
+    }
+    if (span->aligned.load(std::memory_order_relaxed)) {
+        ptr = BlockStart(span, ptr);
+    }
+    ThreadHeap* heap = thread_heap;
+    if (!heap) {
+        if (thread_exited && FreeExited(span, ptr)) {
+            return;
+        }
+        heap = CreateHeap();
+    }
+    Count(heap->free_bytes, ClassSize(cls));
+    Count(heap->free_count[cls], 1);
+    if (PerCpuMode() && FreeCpu(ptr, cls)) {
+        return;
+    }
+    FreeBlock* block = static_cast<FreeBlock*>(ptr);
+    unsigned owner = span->owner;
+    if (owner == 0) {
+        // Heaps without an id share the owner, so not the bitmaps.
+        block->next = heap->free_lists[cls];
+        heap->free_lists[cls] = block;
+        return;
+    }
+    if (owner == heap->id) {
+        FreeSlot(heap, span, ptr);
+        return;
+    }
+
+    if (owner != heap->pending_owner) {
+        FlushRemote(heap);
+        heap->pending_owner = owner;
+    }
+    block->next = heap->pending_head;
+    if (!heap->pending_head) {
+        heap->pending_tail = block;
+    }
+    heap->pending_head = block;
+    if (++heap->pending_count >= REMOTE_BATCH) {
+        FlushRemote(heap);
+    }
+}
+
+/**
+ * Free of a thread that released its heap on exit: the block goes to
+ * the remote list of its owner with a single CAS, so that the thread
+ * does not get a new heap that would never be released.  Returns
+ * false for a block without an owner, which needs a heap.
+ */
+bool MemorySingleton::FreeExited(Span* span, void* ptr) {
+    unsigned owner = span->owner;
+    if (owner == 0) {
+        return false;
+    }
+    FreeBlock* block = static_cast<FreeBlock*>(ptr);
+    PushRemote(heaps[owner].load(std::memory_order_acquire), block, block);
+    return true;
+}
+
+/**
+ * Like Allocate, but the memory is zeroed.  Blocks that were never
+ * handed out before come from mmap and are zeroed already, so only
+ * reused blocks are cleared.
+ */
+void* MemorySingleton::AllocateZeroed(std::size_t size) {
+    if (size > MAX_SMALL_SIZE) {
+        return AllocateLarge(size, true);
+    }
+    // Whether the block is reused is only known once it is taken:
+    // other threads may hand blocks back meanwhile.
+    bool fresh;
+    void* ptr = AllocateSmall(size, &fresh);
+    if (!fresh) {
+        std::memset(ptr, 0, size);
+    }
+    return ptr;
+}
+
+/**
+ * Allocate size bytes aligned to alignment, which has to be a power
+ * of two.
+ */
+void* MemorySingleton::AllocateAligned(std::size_t alignment, std::size_t size) {
+    if (alignment <= MIN_ALIGN_SIZE) {
+        return Allocate(size);
+    }
+    if (size > SIZE_MAX - alignment - ALIGN_SIZE) {
+        return nullptr;
+    }
+    // Blocks of ALIGN_SIZE and up are ALIGN_SIZE'd; an empty object
+    // still needs a byte, or the aligned pointer could be the end of
+    // its block, which is the start of the next one.
+    size = (std::max(size, std::size_t(1)) + (ALIGN_SIZE - 1)) & ~(ALIGN_SIZE - 1);
+    if (alignment <= ALIGN_SIZE) {
+        return Allocate(size);
+    }
+    // So the aligned pointer is at most alignment - ALIGN_SIZE past
+    // the block start.
+    char* block = static_cast<char*>(Allocate(size + alignment - ALIGN_SIZE));
+    if (!block) {
+        return nullptr;
+    }
+    std::uintptr_t misalign = reinterpret_cast<std::uintptr_t>(block) & (alignment - 1);
+    if (!misalign) {
+        return block;
+    }
+    Span* span = FindSpan(block);
+    if (span->cls != LARGE_CLASS && !span->aligned.load(std::memory_order_relaxed)) {
+        span->aligned.store(true, std::memory_order_relaxed);
+    }
+    return block + alignment - misalign;
+}
+
+/**
+ * Number of bytes usable at ptr; 0 for blocks that are not ours.
+ */
+std::size_t MemorySingleton::UsableSize(void* ptr) {
+    if (!ptr) {
+        return 0;
+    }
+    Span* span = FindSpan(ptr);
+    if (!span) {
+        return 0;
+    }
+    char* end;
+    if (span->cls == LARGE_CLASS) {
+        end = reinterpret_cast<char*>(span) + span->size;
+    } else if (span->aligned.load(std::memory_order_relaxed)) {
+        end = BlockStart(span, ptr) + ClassSize(span->cls);
+    } else {
+        return ClassSize(span->cls);
+    }
+    return end - static_cast<char*>(ptr);
+}
+
+/**
+ * Resize the mapping of a large block.  The kernel moves page tables
+ * instead of us copying bytes.
+ */
+void* MemorySingleton::ReallocateLarge(Span* span, std::size_t size) {
+    if (size > SIZE_MAX - SPAN_HEADER_SIZE - PAGE_SIZE) {
+        return nullptr;
+    }
+    std::size_t map_size = span->size;
+    std::size_t new_map_size = PageRound(size + SPAN_HEADER_SIZE);
+    if (new_map_size == map_size) {
+        return SpanBlocks(span);
+    }
+    // The pages may move or go away; they are mapped again below.
+    SetPageMap(reinterpret_cast<char*>(span), map_size, nullptr);
+    void* mem = mremap(span, map_size, new_map_size, MREMAP_MAYMOVE);
+    if (mem == MAP_FAILED) {
+        SetPageMap(reinterpret_cast<char*>(span), map_size, span);
+        return nullptr;
+    }
+    span = static_cast<Span*>(mem);
+    span->size = new_map_size;
+    if (!SetPageMap(static_cast<char*>(mem), new_map_size, span)) {
+        throw std::runtime_error("OOM");
+    }
+    ThreadHeap* heap = LocalHeap();
+    if (new_map_size > map_size) {
+        Count(heap->alloc_bytes, new_map_size - map_size);
+        mmap_stat.fetch_add(new_map_size - map_size);
+        UpdatePeak();
+    } else {
+        Count(heap->free_bytes, map_size - new_map_size);
+        mmap_stat.fetch_sub(map_size - new_map_size);
+    }
+    return SpanBlocks(span);
+}
+
+/**
+ * realloc(3).  Blocks that are not ours cannot be resized, as their
+ * size is unknown.
+ */
+void* MemorySingleton::Reallocate(void* ptr, std::size_t size) {
+    if (!ptr) {
+        return Allocate(size);
+    }
+    if (size == 0) {
+        Free(ptr);
+        return nullptr;
+    }
+    Span* span = FindSpan(ptr);
+    if (!span) {
+        return nullptr;
+    }
+    if (span->cls == LARGE_CLASS && size > MAX_SMALL_SIZE && ptr == SpanBlocks(span)) {
+        return ReallocateLarge(span, size);
+    }
+    if (span->cls == LARGE_CLASS && size <= MAX_SMALL_SIZE) {
+        // Shrunk to a small object: a block of its own, so that the
+        // mapping goes back.
+        void* new_ptr = Allocate(size);
+        std::memcpy(new_ptr, ptr, size);
+        Free(ptr);
+        return new_ptr;
+    }
+    std::size_t usable = UsableSize(ptr);
+    if (size <= usable) {
+        return ptr;
+    }
+
+    void* new_ptr = Allocate(size);
+    if (new_ptr) {
+        std::memcpy(new_ptr, ptr, usable);
+        Free(ptr);
+    }
+    return new_ptr;
+}
+
+
+/**
+ * A field of /proc/self/smaps_rollup, in bytes: the totals of the
+ * whole process.  Read with plain syscalls, as the allocator may be in
+ * use.
+ */
+static std::size_t SmapsRollup(const char* name) {
+    char buf[4096];
+    int fd = open("/proc/self/smaps_rollup", O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0) {
+        return 0;
+    }
+    buf[len] = 0;
+    const char* field = strstr(buf, name);
+    if (!field) {
+        return 0;
+    }
+    return strtoul(field + strlen(name), nullptr, 10) * 1024;
+}
+
+void MemorySingleton::SpanPoolStats(std::size_t* puts, std::size_t* takes) {
+    *puts = pool_put_stat.load();
+    *takes = pool_take_stat.load();
+}
+
+/**
+ * Print totals, then the heaps and size classes that were used.
+ * Counters are summed over all heaps here, so the numbers are only
+ * approximate while other threads allocate.
+ */
 void MemorySingleton::PrintStats() {
+    std::size_t alloc_bytes = 0, free_bytes = 0;
+    std::size_t alloc_count[NUM_CLASSES + 1] = {}, free_count[NUM_CLASSES + 1] = {};
+    for (ThreadHeap* heap = all_heaps.load(); heap; heap = heap->next_heap) {
+        alloc_bytes += heap->alloc_bytes.load(std::memory_order_relaxed);
+        free_bytes += heap->free_bytes.load(std::memory_order_relaxed);
+        for (unsigned cls = 0; cls <= NUM_CLASSES; ++cls) {
+            alloc_count[cls] += heap->alloc_count[cls].load(std::memory_order_relaxed);
+            free_count[cls] += heap->free_count[cls].load(std::memory_order_relaxed);
+        }
+    }
+
     std::cerr << "sbrk size:  " << std::setw(18) << sbrk_stat.load() << std::endl
-              << "alloc size: " << std::setw(18) << alloc_stat.load() << std::endl
-              << "now free:   " << std::setw(18) << free_end.load() - free_begin.load() << std::endl;
+              << "mmap size:  " << std::setw(18) << mmap_stat.load() << std::endl
+              << "peak size:  " << std::setw(18) << peak_stat.load() << std::endl
+              << "tail pool:  " << std::setw(18) << tail_stat.load() << std::endl
+              << "tail lost:  " << std::setw(18) << lost_stat.load() << std::endl
+              << "map cache:  " << std::setw(18) << map_cache_size.load() << std::endl
+              << "span pool:  " << std::setw(18) << span_pool_size.load() << std::endl
+              << "pool puts:  " << std::setw(18) << pool_put_stat.load() << std::endl
+              << "pool takes: " << std::setw(18) << pool_take_stat.load() << std::endl
+              << "alloc size: " << std::setw(18) << alloc_bytes << std::endl
+              << "freed size: " << std::setw(18) << free_bytes << std::endl
+              << "now free:   " << std::setw(18) << LoadRegion().Free() << std::endl;
+    std::cerr << "page map:   " << std::setw(18) << page_map_size.load() << std::endl
+              << "purged:     " << std::setw(18) << purge_stat.load() << std::endl
+              << "resident:   " << std::setw(18) << SmapsRollup("Rss:") << std::endl;
+    if (arena_stat.load()) {
+        std::cerr << "arena size: " << std::setw(18) << arena_stat.load() << std::endl;
+    }
+    if (cpu_caches.load()) {
+        std::cerr << "cpu caches: " << std::setw(18) << cpu_count.load() << std::endl;
+    }
+    if (premap_running.load()) {
+        std::cerr << "premapped:  " << std::setw(18) << premap_stat.load() << std::endl;
+    }
+    if (GetHugePageMode() != HUGE_OFF) {
+        std::cerr << "hugetlb:    " << std::setw(18) << hugetlb_stat.load() << std::endl
+                  << "THP:        " << std::setw(18) << SmapsRollup("AnonHugePages:") / HUGE_PAGE_SIZE
+                  << std::endl;
+    }
+
+    for (ThreadHeap* heap = all_heaps.load(); heap; heap = heap->next_heap) {
+        std::size_t heap_alloc = heap->alloc_bytes.load(std::memory_order_relaxed);
+        if (heap_alloc) {
+            std::cerr << "heap " << std::setw(6) << heap->id
+                      << "  alloc " << std::setw(14) << heap_alloc
+                      << "  freed " << std::setw(14) << heap->free_bytes.load(std::memory_order_relaxed)
+                      << std::endl;
+        }
+    }
+    for (unsigned cls = 0; cls <= NUM_CLASSES; ++cls) {
+        if (alloc_count[cls]) {
+            std::cerr << "class ";
+            if (cls < NUM_CLASSES) {
+                std::cerr << std::setw(6) << ClassSize(cls);
+            } else {
+                std::cerr << " large";
+            }
+            std::cerr << "  count " << std::setw(14) << alloc_count[cls]
+                      << "  freed " << std::setw(14) << free_count[cls] << std::endl;
+        }
+    }
+}
+
+BumpRegions::~BumpRegions() {
+    Release(chunks);
+}
+
+BumpRegions::Chunk* BumpRegions::MapChunk(std::size_t size) {
+    std::size_t unit = RegionUnit();
+    std::size_t map_size = (size + (unit - 1)) & ~(unit - 1);
+    char* mem = MemorySingleton::MapRegion(map_size, false);
+    if (mem == MAP_FAILED) {
+        throw std::bad_alloc();
+    }
+    MemorySingleton::arena_stat.fetch_add(map_size);
+    MemorySingleton::UpdatePeak();
+    Chunk* chunk = reinterpret_cast<Chunk*>(mem);
+    chunk->size = map_size;
+    return chunk;
+}
+
+void BumpRegions::Release(Chunk* chunk) {
+    while (chunk) {
+        Chunk* next = chunk->next;
+        MemorySingleton::arena_stat.fetch_sub(chunk->size);
+        munmap(chunk, chunk->size);
+        chunk = next;
+    }
+}
+
+// Unmap every region but chunk and bump it again from offset.
+void BumpRegions::Keep(Chunk* chunk, std::size_t offset) {
+    Release(chunk->next);
+    chunk->next = nullptr;
+    begin = reinterpret_cast<char*>(chunk) + offset;
+    end = reinterpret_cast<char*>(chunk) + chunk->size;
+}
+
+std::size_t GeometricGrowth::Next(std::size_t size) {
+    return NextRegionSize(size);
 }
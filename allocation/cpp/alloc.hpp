@@ -1,15 +1,195 @@
+#pragma once
+
 #include <atomic>
+#include <cstddef>
 #include <cstdint>
+#include <new>
 
 class MemorySingleton {
-    static std::atomic<char*> free_end;
-    static std::atomic<char*> free_begin;
-    static std::atomic<bool> in_alloc;
-    static std::atomic<std::size_t> alloc_stat;
+    friend class BumpRegions;
+public:
+    struct ThreadHeap;
+    struct Span;
+    struct CpuCache;
+    struct Region;
+private:
+    static Region region;
     static std::atomic<std::size_t> sbrk_stat;
+    static std::atomic<std::size_t> mmap_stat;
+    static std::atomic<std::size_t> peak_stat;
+    static std::atomic<std::size_t> tail_stat;
+    static std::atomic<std::size_t> lost_stat;
+    static std::atomic<std::size_t> hugetlb_stat;
+    static std::atomic<std::size_t> premap_stat;
+    static std::atomic<std::size_t> arena_stat;
+    static std::atomic<std::size_t> purge_stat;
+    static std::atomic<std::size_t> pool_put_stat;
+    static std::atomic<std::size_t> pool_take_stat;
 
-    static char* AllocSbrk(std::size_t size);
+    static void PutTail(char* tail, std::size_t size);
+    static char* TakeTail(std::size_t size);
+    static void PutMapping(char* mem, std::size_t size, bool dirty);
+    static char* TakeMapping(std::size_t* size, bool* dirty);
+    static void DropRegion(char* mem, std::size_t size);
+    static void PutSpan(Span* span, unsigned stripe);
+    static Span* TakeSpan(std::size_t size, unsigned stripe);
+    static void UpdatePeak();
+    static char* MapRegion(std::size_t size, bool populate);
+    static void* PremapLoop(void*);
+    static Region LoadRegion();
+    static bool CompareExchangeRegion(Region expected, Region desired);
+    static char* AllocSbrk(std::size_t size, Region cur);
+    static char* AllocateShared(std::size_t size);
+    static ThreadHeap* CreateHeap();
+    static ThreadHeap* LocalHeap();
+    static void AbandonHeap(void* heap);
+    static void ReleaseHeap(ThreadHeap* heap);
+    static void ForkChild();
+    static void FlushRemote(ThreadHeap* heap);
+    static bool DrainRemote(ThreadHeap* heap);
+    static void FreeSlot(ThreadHeap* heap, Span* span, void* ptr);
+    static void* AllocateSlot(ThreadHeap* heap, unsigned cls);
+    static std::size_t BumpedSlots(ThreadHeap* heap, Span* span);
+    static void QueuePurge(ThreadHeap* heap, Span* span);
+    static void PurgeSpans(ThreadHeap* heap, std::uint32_t now, bool all = false);
+    static void ReleaseSpans(ThreadHeap* heap, Span* released);
+    static char* RefillSpan(ThreadHeap* heap, unsigned cls, std::size_t size);
+    static char* BumpBlocks(ThreadHeap* heap, unsigned cls, std::size_t* count);
+    static CpuCache* CpuCaches();
+    static void* AllocateCpu(ThreadHeap* heap, unsigned cls, bool* fresh);
+    static bool FreeCpu(void* ptr, unsigned cls);
+    static void* AllocateSmall(std::size_t size, bool* fresh);
+    static void* AllocateLarge(std::size_t size, bool zero = false);
+    static void FreeLarge(Span* span);
+    static bool FreeExited(Span* span, void* ptr);
+    static void* ReallocateLarge(Span* span, std::size_t size);
 public:
     static void* Allocate(std::size_t size);
+    static std::size_t AllocateBatch(std::size_t size, std::size_t count, void** out);
+    static void* AllocateZeroed(std::size_t size);
+    static void* AllocateAligned(std::size_t alignment, std::size_t size);
+    static void* Reallocate(void* ptr, std::size_t size);
+    static void Free(void* ptr);
+    static std::size_t UsableSize(void* ptr);
     static void PrintStats();
+    // Number of spans put into and taken from the span pool so far.
+    static void SpanPoolStats(std::size_t* puts, std::size_t* takes);
+    static void StartPremap();
+    static void RegisterForkHandlers();
+};
+
+/**
+ * Region list of a bump allocator: the part of BasicBumpAllocator that
+ * does not depend on its parameters.  Regions come from the same
+ * mapping code as the shared region, so huge page mode applies.
+ */
+class BumpRegions {
+protected:
+    // Header at the start of every region; the head of the list is the
+    // region being bumped.
+    struct Chunk {
+        Chunk* next;
+        std::size_t size;
+    };
+
+    Chunk* chunks = nullptr;
+    char* begin = nullptr;
+    char* end = nullptr;
+    std::size_t next_size = 0;
+
+    BumpRegions() = default;
+    ~BumpRegions();
+    // Map a region of at least size bytes; throws std::bad_alloc.
+    static Chunk* MapChunk(std::size_t size);
+    static void Release(Chunk* chunk);
+    void Keep(Chunk* chunk, std::size_t offset);
+public:
+    BumpRegions(const BumpRegions&) = delete;
+    BumpRegions& operator=(const BumpRegions&) = delete;
 };
+
+/**
+ * Scoped bump allocator: objects are never freed one by one, Reset
+ * drops all of them at once and the destructor unmaps every region.
+ * Align is the alignment of every object, ChunkSize the minimal region
+ * size and Growth::Next(size) the size of the region mapped after one
+ * of size bytes.  Not thread-safe; use one per thread or per request.
+ */
+template<std::size_t Align, std::size_t ChunkSize, class Growth>
+class BasicBumpAllocator : public BumpRegions {
+    static_assert(!(Align & (Align - 1)),
+                  "Align has to be a power of two");
+    static_assert(Align <= 4096,
+                  "Align cannot exceed the page size");
+    static_assert(ChunkSize % Align == 0,
+                  "ChunkSize has to be aligned to Align'd");
+    static_assert(ChunkSize > sizeof(Chunk),
+                  "ChunkSize has to fit the region header");
+
+    // Objects start past the region header.
+    static constexpr std::size_t CHUNK_HEADER_SIZE = (sizeof(Chunk) + (Align - 1)) & ~(Align - 1);
+
+    void* Refill(std::size_t size);
+public:
+    void* Allocate(std::size_t size) {
+        if (size == 0) {
+            size = 1;
+        }
+        if (size > static_cast<std::size_t>(end - begin)) {
+            return Refill(size);
+        }
+        char* res = begin;
+        begin += (size + (Align - 1)) & ~(Align - 1);
+        return res;
+    }
+
+    // Forget all objects, keeping only the current region for reuse.
+    void Reset() {
+        if (chunks) {
+            Keep(chunks, CHUNK_HEADER_SIZE);
+        }
+    }
+};
+
+/**
+ * Map a region for size bytes.  A request that would not leave most of
+ * a normal region free gets a region of its own, linked behind the
+ * current one, which keeps being bumped.
+ */
+template<std::size_t Align, std::size_t ChunkSize, class Growth>
+void* BasicBumpAllocator<Align, ChunkSize, Growth>::Refill(std::size_t size) {
+    if (size > SIZE_MAX / 2) {
+        throw std::bad_alloc();
+    }
+    std::size_t need = CHUNK_HEADER_SIZE + ((size + (Align - 1)) & ~(Align - 1));
+    std::size_t want = next_size > ChunkSize ? next_size : ChunkSize;
+    Chunk* chunk = MapChunk(need > want ? need : want);
+    char* res = reinterpret_cast<char*>(chunk) + CHUNK_HEADER_SIZE;
+    if (chunks && chunk->size - need < static_cast<std::size_t>(end - begin)) {
+        chunk->next = chunks->next;
+        chunks->next = chunk;
+        return res;
+    }
+    chunk->next = chunks;
+    chunks = chunk;
+    begin = reinterpret_cast<char*>(chunk) + need;
+    end = reinterpret_cast<char*>(chunk) + chunk->size;
+    next_size = Growth::Next(chunk->size);
+    return res;
+}
+
+// Growth policies.  GeometricGrowth follows the settings of the shared
+// region (ATOMIC_MALLOC_REGION_GROWTH and friends).
+struct GeometricGrowth {
+    static std::size_t Next(std::size_t size);
+};
+
+struct FixedGrowth {
+    static std::size_t Next(std::size_t) {
+        return 0;
+    }
+};
+
+typedef BasicBumpAllocator<alignof(std::max_align_t), 64 * 1024, GeometricGrowth> Arena;
+// For SIMD buffers: every object is aligned to a cache line.
+typedef BasicBumpAllocator<64, 64 * 1024, GeometricGrowth> SimdArena;
@@ -1,9 +1,24 @@
 #include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <vector>
 #include <stdexcept>
+#include <string>
 #include <thread>
 #include <utility>
+#include <malloc.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "alloc.hpp"
+#include "atomic_allocator.hpp"
 
 struct List {
     List* next;
@@ -24,6 +39,37 @@ void AllocateNodes(int id, int count, List** result) {
     *result = list;
 }
 
+// Provided by the preloaded library only.
+extern "C" size_t atomic_malloc_batch(size_t sz, size_t count, void** out) __attribute__((weak));
+
+// Like AllocateNodes, but nodes and payloads are allocated in batches.
+void AllocateNodesBatched(int id, int count, List** result) {
+    constexpr int BATCH = 64;
+    void* nodes[BATCH];
+    void* payloads[BATCH];
+    List* list = nullptr;
+    for (int i = 0; i < count; i += BATCH) {
+        size_t n = std::min(BATCH, count - i);
+        size_t payloadSize = 0;
+        size_t got = atomic_malloc_batch ? atomic_malloc_batch(sizeof(List), n, nodes) : 0;
+        for (; got < n; ++got) {
+            nodes[got] = malloc(sizeof(List));
+        }
+        got = atomic_malloc_batch ? atomic_malloc_batch(payloadSize, n, payloads) : 0;
+        for (; got < n; ++got) {
+            payloads[got] = malloc(payloadSize);
+        }
+        for (size_t j = 0; j < n; ++j) {
+            List* node = static_cast<List*>(nodes[j]);
+            node->next = list;
+            node->payload = payloads[j];
+            node->value = id;
+            list = node;
+        }
+    }
+    *result = list;
+}
+
 bool CheckList(const List* n, int id) {
     while (n) {
         if (n->value != id) {
@@ -34,8 +80,306 @@ bool CheckList(const List* n, int id) {
     return true;
 }
 
+void FreeList(List* n) {
+    while (n) {
+        List* next = n->next;
+        free(n->payload);
+        free(n);
+        n = next;
+    }
+}
+
+// Builds and frees a list over and over, so that freed blocks are
+// reused by later allocations.
+void ChurnNodes(int id, int rounds, int count, bool* result) {
+    bool ok = true;
+    for (int i = 0; i < rounds; ++i) {
+        List* list;
+        AllocateNodes(id, count, &list);
+        ok = CheckList(list, id) && ok;
+        FreeList(list);
+    }
+    *result = ok;
+}
+
+/**
+ * Fork while another thread allocates and frees; the child has to be
+ * able to allocate from new threads, and to free blocks of the parent.
+ */
+bool CheckFork() {
+    List* list;
+    AllocateNodes(1, 100000, &list);
+    bool churned;
+    std::thread churn([&]() { ChurnNodes(2, 20, 40000, &churned); });
+    pid_t pid = fork();
+    if (pid == 0) {
+        bool ok = CheckList(list, 1);
+        FreeList(list);
+        bool c1, c2;
+        std::thread t1([&]() { ChurnNodes(3, 10, 40000, &c1); });
+        std::thread t2([&]() { ChurnNodes(4, 10, 40000, &c2); });
+        t1.join();
+        t2.join();
+        _exit(ok && c1 && c2 ? 0 : 1);
+    }
+    churn.join();
+    int status = -1;
+    waitpid(pid, &status, 0);
+    FreeList(list);
+    return pid > 0 && churned && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
 
-void AddPointers(std::vector<std::pair<char*, char*>>* data, const List* list) {
+/**
+ * Waves of short-lived threads sharing a fixed amount of work, as in
+ * thread-per-connection servers.  Prints the time of each wave.
+ */
+bool RunWaves(int num_threads, int waves) {
+    bool ok = true;
+    int count = 400000 / num_threads;
+    for (int wave = 0; wave < waves; ++wave) {
+        std::unique_ptr<bool[]> results(new bool[num_threads]);
+        std::vector<std::thread> threads;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < num_threads; ++i) {
+            threads.emplace_back(ChurnNodes, i + 1, 10, count, &results[i]);
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        std::cerr << "threads " << num_threads << " wave " << wave << ": " << elapsed.count() << " ms" << std::endl;
+        ok = std::all_of(results.get(), results.get() + num_threads, [](bool r) { return r; }) && ok;
+    }
+    return ok;
+}
+
+// Threads that fill spans of a few classes with tagged blocks and free
+// them all, over and over.
+bool StressSpans(int num_threads, int rounds) {
+    constexpr int BLOCKS = 1024;
+    std::unique_ptr<bool[]> results(new bool[num_threads]);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < num_threads; ++i) {
+        threads.emplace_back([i, rounds, &results]() {
+            std::vector<std::uint64_t*> blocks(BLOCKS);
+            bool ok = true;
+            for (int round = 0; round < rounds; ++round) {
+                std::size_t words = 8 << (round + i) % 4;
+                std::uint64_t tag = std::uint64_t(i) << 32 | round;
+                for (auto& block : blocks) {
+                    block = static_cast<std::uint64_t*>(
+                        MemorySingleton::AllocateZeroed(words * sizeof(std::uint64_t)));
+                    ok = !block[0] && !block[words - 1] && ok;
+                    block[0] = block[words - 1] = tag;
+                }
+                for (auto block : blocks) {
+                    ok = block[0] == tag && block[words - 1] == tag && ok;
+                    MemorySingleton::Free(block);
+                }
+            }
+            results[i] = ok;
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    return std::all_of(results.get(), results.get() + num_threads, [](bool r) { return r; });
+}
+
+/**
+ * Stress the span pool with many threads until spans went through it.
+ * A span popped twice because of ABA would be carved by two threads at
+ * once and show up as overwritten tags; one that is not cleaned up for
+ * reuse, as zeroed blocks that are not.  Uses MemorySingleton directly,
+ * as malloc is not ours without the preloaded library.  Spans are
+ * released after the purge decay, hence the waves; per-CPU caches keep
+ * freed blocks out of the slabs, so the pool is not used with them.
+ */
+bool CheckSpanPool(int num_threads, int rounds) {
+    constexpr int MAX_WAVES = 30;
+    const char* per_cpu = getenv("ATOMIC_MALLOC_PERCPU");
+    bool pooled = !per_cpu || !atoi(per_cpu);
+    std::size_t puts_before, takes_before;
+    MemorySingleton::SpanPoolStats(&puts_before, &takes_before);
+    bool ok = true;
+    for (int wave = 0; wave < MAX_WAVES; ++wave) {
+        ok = StressSpans(num_threads, rounds) && ok;
+        std::size_t puts, takes;
+        MemorySingleton::SpanPoolStats(&puts, &takes);
+        if (puts > puts_before && takes > takes_before) {
+            return ok;
+        }
+        if (!pooled) {
+            return ok && puts == puts_before;
+        }
+    }
+    return false;
+}
+
+/**
+ * Bounded queue of lists passed from a producer to a consumer thread.
+ */
+class ListQueue {
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<List*> lists;
+    bool closed = false;
+public:
+    static constexpr std::size_t MAX_LISTS = 4;
+
+    void Push(List* list) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cond.wait(lock, [this]() { return lists.size() < MAX_LISTS; });
+        lists.push_back(list);
+        cond.notify_all();
+    }
+
+    void Close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        cond.notify_all();
+    }
+
+    bool Pop(List** list) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cond.wait(lock, [this]() { return closed || !lists.empty(); });
+        if (lists.empty()) {
+            return false;
+        }
+        *list = lists.front();
+        lists.pop_front();
+        cond.notify_all();
+        return true;
+    }
+};
+
+void ProduceLists(int id, int rounds, int count, ListQueue* queue) {
+    for (int i = 0; i < rounds; ++i) {
+        List* list;
+        AllocateNodes(id, count, &list);
+        queue->Push(list);
+    }
+    queue->Close();
+}
+
+// Every node is freed by a thread other than the one that allocated
+// it.
+void ConsumeLists(int id, ListQueue* queue, bool* result) {
+    bool ok = true;
+    List* list;
+    while (queue->Pop(&list)) {
+        ok = CheckList(list, id) && ok;
+        FreeList(list);
+    }
+    *result = ok;
+}
+
+static bool IsAligned(void* ptr, std::size_t alignment) {
+    return reinterpret_cast<std::uintptr_t>(ptr) % alignment == 0;
+}
+
+// The rest of the malloc family, which has to come from the same heap
+// as malloc and free.
+bool CheckMallocFamily() {
+    bool ok = true;
+
+    // Only the smallest blocks, which cannot hold anything that needs
+    // more, are aligned for a pointer alone.
+    for (std::size_t size : {1, 8, 9, 24, 40, 56, 100, 1000, 40000}) {
+        void* ptr = malloc(size);
+        ok = ok && IsAligned(ptr, size > sizeof(void*) ? alignof(std::max_align_t) : sizeof(void*));
+        free(ptr);
+    }
+
+    // A reused block has to be cleared.
+    char* dirty = static_cast<char*>(malloc(100));
+    std::memset(dirty, 0xff, 100);
+    free(dirty);
+    for (std::size_t size : {100, 5000, 100000}) {
+        char* zeroed = static_cast<char*>(calloc(size, 1));
+        ok = ok && std::all_of(zeroed, zeroed + size, [](char c) { return c == 0; });
+        free(zeroed);
+    }
+
+    char* buf = nullptr;
+    std::size_t size = 0;
+    for (std::size_t new_size = 1; new_size <= (1 << 22); new_size *= 3) {
+        buf = static_cast<char*>(realloc(buf, new_size));
+        ok = ok && malloc_usable_size(buf) >= new_size;
+        for (std::size_t i = 0; i < size; ++i) {
+            ok = ok && buf[i] == static_cast<char>(i);
+        }
+        for (std::size_t i = size; i < new_size; ++i) {
+            buf[i] = static_cast<char>(i);
+        }
+        size = new_size;
+    }
+    // Shrinking a large object gives its pages back.
+    buf = static_cast<char*>(realloc(buf, 10));
+    ok = ok && buf[9] == 9 && malloc_usable_size(buf) < 4096;
+    free(buf);
+
+    for (std::size_t alignment : {16, 64, 4096, 1 << 16}) {
+        void* ptr = nullptr;
+        ok = ok && posix_memalign(&ptr, alignment, 40) == 0 && IsAligned(ptr, alignment);
+        ok = ok && malloc_usable_size(ptr) >= 40;
+        free(ptr);
+        ptr = aligned_alloc(alignment, 3 * alignment);
+        ok = ok && IsAligned(ptr, alignment) && malloc_usable_size(ptr) >= 3 * alignment;
+        ptr = realloc(ptr, 6 * alignment);
+        free(ptr);
+        ptr = memalign(alignment, 100000);
+        ok = ok && IsAligned(ptr, alignment);
+        free(ptr);
+    }
+
+    // Empty aligned objects still have to be distinct.
+    for (std::size_t alignment : {16, 32, 64}) {
+        std::vector<void*> ptrs(64);
+        for (auto& ptr : ptrs) {
+            ok = ok && posix_memalign(&ptr, alignment, 0) == 0 && IsAligned(ptr, alignment);
+        }
+        std::sort(ptrs.begin(), ptrs.end());
+        ok = ok && std::adjacent_find(ptrs.begin(), ptrs.end()) == ptrs.end();
+        for (auto ptr : ptrs) {
+            free(ptr);
+        }
+    }
+    return ok;
+}
+
+// Lists built in an arena, dropped with Reset and by the destructor.
+bool CheckArena() {
+    bool ok = true;
+    Arena arena;
+    for (int round = 0; round < 3; ++round) {
+        List* list = nullptr;
+        for (int i = 0; i < 100000; ++i) {
+            List* node = static_cast<List*>(arena.Allocate(sizeof(List)));
+            ok = ok && IsAligned(node, alignof(List));
+            node->next = list;
+            node->payload = arena.Allocate(i % 7 ? 24 : 100000);
+            std::memset(node->payload, round, i % 7 ? 24 : 100000);
+            node->value = round;
+            list = node;
+        }
+        ok = ok && CheckList(list, round);
+        arena.Reset();
+    }
+
+    SimdArena simd;
+    for (std::size_t size : {1, 100, 1000, 100000}) {
+        float* buf = static_cast<float*>(simd.Allocate(size * sizeof(float)));
+        ok = ok && IsAligned(buf, 64);
+        std::fill(buf, buf + size, 1.0f);
+    }
+    return ok;
+}
+
+// Through the adapter, from the MemorySingleton linked into the test.
+typedef std::vector<std::pair<char*, char*>, AtomicAllocator<std::pair<char*, char*>>> PointerVector;
+
+void AddPointers(PointerVector* data, const List* list) {
     while (list) {
         char *l = (char*)list;
         char *p = (char*)(list->payload);
@@ -45,7 +389,7 @@ void AddPointers(std::vector<std::pair<char*, char*>>* data, const List* list) {
     }
 }
 
-void ValidatePointers(std::vector<std::pair<char*, char*>>* data) {
+void ValidatePointers(PointerVector* data) {
     std::sort(std::begin(*data), std::end(*data));
     for (auto it = std::next(std::begin(*data)); it < std::end(*data); ++it) {
         auto p = std::prev(it);
@@ -58,7 +402,19 @@ void ValidatePointers(std::vector<std::pair<char*, char*>>* data) {
     }
 }
 
-int main() {
+int main(int argc, char* argv[]) {
+    // Before the allocator reads it: free spans go to the span pool
+    // right away, so that CheckSpanPool does not have to wait.
+    setenv("ATOMIC_MALLOC_PURGE_DECAY", "0", 0);
+    if (argc > 1) {
+        std::cerr << RunWaves(std::stoi(argv[1]), 4) << std::endl;
+        return 0;
+    }
+    bool m = CheckMallocFamily(), ar = CheckArena(), f = CheckFork();
+    bool sp = CheckSpanPool(16, 2000);
+    std::cerr << m << ' ' << ar << ' ' << f << ' ' << sp << std::endl;
+    bool ok = m && ar && f && sp;
+
     List* n1;
     List* n2;
     List* n3;
@@ -67,8 +423,8 @@ int main() {
     void *a = malloc(255);
     std::thread t1([&]() { AllocateNodes(1, 4000000, &n1); });
     std::thread t2([&]() { AllocateNodes(2, 4000000, &n2); });
-    std::thread t3([&]() { AllocateNodes(3, 4000000, &n3); });
-    std::thread t4([&]() { AllocateNodes(4, 4000000, &n4); });
+    std::thread t3([&]() { AllocateNodesBatched(3, 4000000, &n3); });
+    std::thread t4([&]() { AllocateNodesBatched(4, 4000000, &n4); });
     t1.join();
     t2.join();
     t3.join();
@@ -76,11 +432,39 @@ int main() {
     void *b = malloc(100);
 
     std::cerr << a << ' ' << b << std::endl;
-    std::cerr << CheckList(n1, 1) << " " << CheckList(n2, 2) << std::endl;
-    std::cerr << CheckList(n3, 3) << " " << CheckList(n4, 4) << std::endl;
+    bool l1 = CheckList(n1, 1), l2 = CheckList(n2, 2);
+    bool l3 = CheckList(n3, 3), l4 = CheckList(n4, 4);
+    std::cerr << l1 << " " << l2 << std::endl;
+    std::cerr << l3 << " " << l4 << std::endl;
+    ok = ok && l1 && l2 && l3 && l4;
+
+    bool c1, c2, c3, c4;
+    std::thread ct1([&]() { ChurnNodes(1, 100, 40000, &c1); });
+    std::thread ct2([&]() { ChurnNodes(2, 100, 40000, &c2); });
+    std::thread ct3([&]() { ChurnNodes(3, 100, 40000, &c3); });
+    std::thread ct4([&]() { ChurnNodes(4, 100, 40000, &c4); });
+    ct1.join();
+    ct2.join();
+    ct3.join();
+    ct4.join();
+    std::cerr << c1 << " " << c2 << " " << c3 << " " << c4 << std::endl;
+    ok = ok && c1 && c2 && c3 && c4;
+
+    ListQueue q1, q2;
+    bool p1, p2;
+    std::thread pt1([&]() { ProduceLists(1, 100, 40000, &q1); });
+    std::thread pt2([&]() { ProduceLists(2, 100, 40000, &q2); });
+    std::thread pc1([&]() { ConsumeLists(1, &q1, &p1); });
+    std::thread pc2([&]() { ConsumeLists(2, &q2, &p2); });
+    pt1.join();
+    pt2.join();
+    pc1.join();
+    pc2.join();
+    std::cerr << p1 << " " << p2 << std::endl;
+    ok = ok && p1 && p2;
 
 #ifdef VALIDATE_POINTERS
-    std::vector<std::pair<char*, char*>> pointers;
+    PointerVector pointers;
     // Alot...
     pointers.reserve(2*4*4000000);
     AddPointers(&pointers, n1);
@@ -89,5 +473,5 @@ int main() {
     AddPointers(&pointers, n4);
     ValidatePointers(&pointers);
 #endif
-    return 0;
+    return ok ? 0 : 1;
 }
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include "alloc.hpp"
+
+/**
+ * Standard allocator on top of MemorySingleton, or of an arena if one
+ * is given.  Arena memory is only released with the arena, so
+ * deallocate does nothing then.  Copies and rebinds share the arena,
+ * and allocators compare equal when they use the same one.
+ */
+template<class T>
+class AtomicAllocator {
+    Arena* arena;
+public:
+    typedef T value_type;
+
+    AtomicAllocator() noexcept : arena(nullptr) {
+    }
+
+    explicit AtomicAllocator(Arena* arena) noexcept : arena(arena) {
+    }
+
+    template<class U>
+    AtomicAllocator(const AtomicAllocator<U>& other) noexcept : arena(other.GetArena()) {
+    }
+
+    T* allocate(std::size_t n) {
+        if (n > SIZE_MAX / sizeof(T)) {
+            throw std::bad_alloc();
+        }
+        std::size_t size = n * sizeof(T);
+        void* ptr;
+        if (!arena) {
+            ptr = MemorySingleton::AllocateAligned(alignof(T), size);
+        } else if (alignof(T) <= alignof(std::max_align_t)) {
+            ptr = arena->Allocate(size);
+        } else {
+            if (size > SIZE_MAX - alignof(T)) {
+                throw std::bad_alloc();
+            }
+            std::uintptr_t raw = reinterpret_cast<std::uintptr_t>(arena->Allocate(size + alignof(T)));
+            ptr = reinterpret_cast<void*>((raw + alignof(T) - 1) & ~(alignof(T) - 1));
+        }
+        if (!ptr) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(ptr);
+    }
+
+    void deallocate(T* ptr, std::size_t) noexcept {
+        if (!arena) {
+            MemorySingleton::Free(ptr);
+        }
+    }
+
+    Arena* GetArena() const noexcept {
+        return arena;
+    }
+};
+
+template<class T, class U>
+bool operator==(const AtomicAllocator<T>& a, const AtomicAllocator<U>& b) noexcept {
+    return a.GetArena() == b.GetArena();
+}
+
+template<class T, class U>
+bool operator!=(const AtomicAllocator<T>& a, const AtomicAllocator<U>& b) noexcept {
+    return a.GetArena() != b.GetArena();
+}
@@ -0,0 +1,69 @@
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include "atomic_allocator.hpp"
+
+/**
+ * Node-based containers with the default allocator and with
+ * AtomicAllocator, on the heap and on an arena.  Every round fills a
+ * container with count elements and destroys it.
+ */
+
+template<class Alloc>
+std::size_t FillMap(int count, const Alloc& alloc) {
+    typedef typename std::allocator_traits<Alloc>::template rebind_alloc<std::pair<const int, int>> MapAlloc;
+    std::map<int, int, std::less<int>, MapAlloc> map{MapAlloc(alloc)};
+    std::uint32_t state = 1;
+    for (int i = 0; i < count; ++i) {
+        state = state * 1664525 + 1013904223;
+        map[state] = i;
+    }
+    return map.size();
+}
+
+template<class Alloc>
+std::size_t FillList(int count, const Alloc& alloc) {
+    std::list<int, Alloc> list{alloc};
+    for (int i = 0; i < count; ++i) {
+        list.push_back(i);
+    }
+    return list.size();
+}
+
+template<class Fill>
+void Run(const char* name, Fill fill, int count, int rounds) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; ++i) {
+        if (fill(count) != static_cast<std::size_t>(count)) {
+            std::cerr << "FAILURE" << std::endl;
+        }
+    }
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    std::cerr << name << elapsed.count() / rounds << " ms" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    int count = argc > 1 ? std::stoi(argv[1]) : 1000000;
+    int rounds = argc > 2 ? std::stoi(argv[2]) : 4;
+    Arena arena;
+
+    Run("map std:     ", [](int n) { return FillMap(n, std::allocator<int>()); }, count, rounds);
+    Run("map atomic:  ", [](int n) { return FillMap(n, AtomicAllocator<int>()); }, count, rounds);
+    Run("map arena:   ", [&](int n) {
+        std::size_t size = FillMap(n, AtomicAllocator<int>(&arena));
+        arena.Reset();
+        return size;
+    }, count, rounds);
+    Run("list std:    ", [](int n) { return FillList(n, std::allocator<int>()); }, count, rounds);
+    Run("list atomic: ", [](int n) { return FillList(n, AtomicAllocator<int>()); }, count, rounds);
+    Run("list arena:  ", [&](int n) {
+        std::size_t size = FillList(n, AtomicAllocator<int>(&arena));
+        arena.Reset();
+        return size;
+    }, count, rounds);
+    return 0;
+}
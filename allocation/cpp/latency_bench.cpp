@@ -0,0 +1,54 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Allocation latency under contention: every thread allocates objects
+ * of pseudo-random sizes up to 4 KiB, so both the thread chunks and the
+ * shared region are exercised, and records the time of each call.
+ * Nothing is freed, so regions run out and get replaced often.
+ */
+
+void Measure(unsigned seed, int calls, std::vector<std::uint32_t>* latencies) {
+    latencies->reserve(calls);
+    std::uint32_t state = seed;
+    for (int i = 0; i < calls; ++i) {
+        state = state * 1664525 + 1013904223;
+        std::size_t size = 16 + (state >> 8) % 4096;
+        auto start = std::chrono::steady_clock::now();
+        void* volatile ptr = malloc(size);
+        auto stop = std::chrono::steady_clock::now();
+        static_cast<char*>(ptr)[0] = 1;
+        latencies->push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start).count());
+    }
+}
+
+int main(int argc, char* argv[]) {
+    int num_threads = argc > 1 ? std::stoi(argv[1]) : 8;
+    int calls = argc > 2 ? std::stoi(argv[2]) : 50000;
+
+    std::vector<std::vector<std::uint32_t>> latencies(num_threads);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < num_threads; ++i) {
+        threads.emplace_back(Measure, i + 1, calls, &latencies[i]);
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    std::vector<std::uint32_t> all;
+    for (const auto& l : latencies) {
+        all.insert(all.end(), l.begin(), l.end());
+    }
+    std::sort(all.begin(), all.end());
+    for (double q : {0.5, 0.99, 0.999, 0.9999}) {
+        std::cerr << "p" << q * 100 << ": " << all[static_cast<std::size_t>(q * all.size())] << " ns" << std::endl;
+    }
+    std::cerr << "max: " << all.back() << " ns" << std::endl;
+    return 0;
+}
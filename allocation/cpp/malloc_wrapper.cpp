@@ -1,18 +1,123 @@
 #include <cstddef>
+#include <cerrno>
 #include "alloc.hpp"
 
+static void initialize() __attribute__((constructor));
 static void finalize() __attribute__((destructor));
 
+void initialize() {
+   MemorySingleton::RegisterForkHandlers();
+   MemorySingleton::StartPremap();
+}
+
 void finalize() {
    MemorySingleton::PrintStats();
 }
 
-extern "C" 
+static inline bool IsPowerOfTwo(size_t n) {
+   return n && !(n & (n - 1));
+}
+
+extern "C"
 void* malloc(size_t sz) {
    return MemorySingleton::Allocate(sz);
 }
 
-extern "C" 
-void free(void*) {
+extern "C"
+void free(void* ptr) {
+   MemorySingleton::Free(ptr);
+}
+
+extern "C"
+void* calloc(size_t nmemb, size_t sz) {
+   if (sz && nmemb > SIZE_MAX / sz) {
+      errno = ENOMEM;
+      return nullptr;
+   }
+   return MemorySingleton::AllocateZeroed(nmemb * sz);
+}
+
+extern "C"
+void* realloc(void* ptr, size_t sz) {
+   void* res = MemorySingleton::Reallocate(ptr, sz);
+   if (!res && sz) {
+      errno = ENOMEM;
+   }
+   return res;
+}
+
+extern "C"
+void* reallocarray(void* ptr, size_t nmemb, size_t sz) {
+   if (sz && nmemb > SIZE_MAX / sz) {
+      errno = ENOMEM;
+      return nullptr;
+   }
+   return realloc(ptr, nmemb * sz);
+}
+
+extern "C"
+int posix_memalign(void** res, size_t alignment, size_t sz) {
+   if (!IsPowerOfTwo(alignment) || alignment % sizeof(void*)) {
+      return EINVAL;
+   }
+   void* ptr = MemorySingleton::AllocateAligned(alignment, sz);
+   if (!ptr) {
+      return ENOMEM;
+   }
+   *res = ptr;
+   return 0;
 }
 
+extern "C"
+void* aligned_alloc(size_t alignment, size_t sz) {
+   if (!IsPowerOfTwo(alignment)) {
+      errno = EINVAL;
+      return nullptr;
+   }
+   return MemorySingleton::AllocateAligned(alignment, sz);
+}
+
+extern "C"
+void* memalign(size_t alignment, size_t sz) {
+   // Like glibc, round a bad alignment up to a power of two.
+   size_t align = 1;
+   while (align && align < alignment) {
+      align <<= 1;
+   }
+   if (!align) {
+      errno = EINVAL;
+      return nullptr;
+   }
+   return MemorySingleton::AllocateAligned(align, sz);
+}
+
+extern "C"
+void* valloc(size_t sz) {
+   return MemorySingleton::AllocateAligned(4096, sz);
+}
+
+extern "C"
+void* pvalloc(size_t sz) {
+   if (sz > SIZE_MAX - 4095) {
+      errno = ENOMEM;
+      return nullptr;
+   }
+   return MemorySingleton::AllocateAligned(4096, (sz + 4095) & ~size_t(4095));
+}
+
+extern "C"
+size_t malloc_usable_size(void* ptr) {
+   return MemorySingleton::UsableSize(ptr);
+}
+
+// Not part of the malloc family: allocate count objects of sz bytes
+// into out with at most two span bumps; returns how many were allocated.
+// Each object is released with free.
+extern "C"
+size_t atomic_malloc_batch(size_t sz, size_t count, void** out) {
+   size_t n = MemorySingleton::AllocateBatch(sz, count, out);
+   if (n < count) {
+      errno = ENOMEM;
+   }
+   return n;
+}
@@ -0,0 +1,62 @@
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+/**
+ * Growing buffer benchmark: the buffer doubles until it reaches
+ * max_size, every new byte is written once.
+ */
+
+// Growth through realloc, which may move the pages instead of copying.
+char* GrowRealloc(std::size_t max_size) {
+    std::size_t size = 4096;
+    char* buf = static_cast<char*>(malloc(size));
+    std::memset(buf, 1, size);
+    while (size < max_size) {
+        buf = static_cast<char*>(realloc(buf, 2 * size));
+        std::memset(buf + size, 1, size);
+        size *= 2;
+    }
+    return buf;
+}
+
+// Growth by copying into a new buffer.
+char* GrowCopy(std::size_t max_size) {
+    std::size_t size = 4096;
+    char* buf = static_cast<char*>(malloc(size));
+    std::memset(buf, 1, size);
+    while (size < max_size) {
+        char* new_buf = static_cast<char*>(malloc(2 * size));
+        std::memcpy(new_buf, buf, size);
+        free(buf);
+        buf = new_buf;
+        std::memset(buf + size, 1, size);
+        size *= 2;
+    }
+    return buf;
+}
+
+template<class Grow>
+void Run(const char* name, Grow grow, std::size_t max_size, int rounds) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; ++i) {
+        char* buf = grow(max_size);
+        if (buf[max_size - 1] != 1) {
+            std::cerr << "FAILURE" << std::endl;
+        }
+        free(buf);
+    }
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    std::cerr << name << elapsed.count() / rounds << " ms" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    std::size_t max_mb = argc > 1 ? std::stoul(argv[1]) : 256;
+    int rounds = argc > 2 ? std::stoi(argv[2]) : 4;
+
+    Run("realloc: ", GrowRealloc, max_mb << 20, rounds);
+    Run("copy:    ", GrowCopy, max_mb << 20, rounds);
+    return 0;
+}
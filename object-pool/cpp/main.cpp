@@ -3,10 +3,22 @@
 #include <vector>
 #include <memory>
 
+// Keep the bins in the atomic allocator; build with
+// -DUSE_ATOMIC_ALLOCATOR -std=c++14 -mcx16 -pthread and link with
+// ../../allocation/cpp/alloc.cpp.
+#ifdef USE_ATOMIC_ALLOCATOR
+#include "../../allocation/cpp/atomic_allocator.hpp"
+template<class T>
+using BinAllocator = AtomicAllocator<T>;
+#else
+template<class T>
+using BinAllocator = std::allocator<T>;
+#endif
+
 template<class Intern, class Interned>
 class DumbSet {
 private:
-  std::vector<std::weak_ptr<Interned>> bins;
+  std::vector<std::weak_ptr<Interned>, BinAllocator<std::weak_ptr<Interned>>> bins;
 public:
   DumbSet() : bins{} {
   }